@@ -0,0 +1,252 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Compares two benchmark JSON files written with --json. Rows are matched by
+// label and their repetition times are compared with Welch's t-test, so a
+// change is only reported when it stands out from the run-to-run noise.
+
+#define MAX_ROWS 256
+#define MAX_LABEL 64
+
+typedef struct {
+  char label[MAX_LABEL];
+  int n;
+  double mean;
+  double var;
+} Row;
+
+char *read_file(const char *path) {
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    perror(path);
+    return NULL;
+  }
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  rewind(f);
+  char *buf = malloc(size + 1);
+  if (!buf) {
+    fprintf(stderr, "Memory allocation error\n");
+    exit(1);
+  }
+  size_t got = fread(buf, 1, size, f);
+  buf[got] = '\0';
+  fclose(f);
+  return buf;
+}
+
+// Every "times" array becomes a row named by the "label" before it. This is
+// not a general JSON parser, only enough for the files the tools write.
+int parse_rows(const char *text, Row *rows) {
+  int num_rows = 0;
+  const char *p = text;
+  while (num_rows < MAX_ROWS && (p = strstr(p, "\"times\": [")) != NULL) {
+    const char *label = NULL;
+    for (const char *q = text; (q = strstr(q, "\"label\": \"")) && q < p; q++)
+      label = q + strlen("\"label\": \"");
+    p += strlen("\"times\": [");
+    if (!label)
+      continue;
+
+    Row *row = &rows[num_rows];
+    int len = strcspn(label, "\"");
+    if (len >= MAX_LABEL)
+      len = MAX_LABEL - 1;
+    memcpy(row->label, label, len);
+    row->label[len] = '\0';
+
+    double sum = 0, sq = 0;
+    row->n = 0;
+    for (;;) {
+      char *end;
+      double v = strtod(p, &end);
+      if (end == p)
+        break;
+      sum += v;
+      sq += v * v;
+      row->n++;
+      p = end + strspn(end, ", \n");
+    }
+    if (row->n == 0)
+      continue;
+    row->mean = sum / row->n;
+    row->var = row->n > 1 ? (sq - sum * sum / row->n) / (row->n - 1) : 0;
+    if (row->var < 0)
+      row->var = 0;
+    num_rows++;
+  }
+  return num_rows;
+}
+
+// Copies the first result fingerprint of a file to first, empty if there is
+// none, and returns how many others differ from it. Every row of one file
+// counts the same input, so they should all agree.
+int scan_fingerprints(const char *text, char *first) {
+  const char *key = "\"fingerprint\": \"";
+  int differ = 0;
+  first[0] = '\0';
+  for (const char *p = text; (p = strstr(p, key)) != NULL;) {
+    p += strlen(key);
+    char digest[17];
+    int len = strcspn(p, "\"");
+    if (len > 16)
+      len = 16;
+    memcpy(digest, p, len);
+    digest[len] = '\0';
+    if (!first[0])
+      strcpy(first, digest);
+    else
+      differ += strcmp(first, digest) != 0;
+  }
+  return differ;
+}
+
+// Continued fraction of the regularized incomplete beta function.
+double beta_fraction(double a, double b, double x) {
+  const double tiny = 1e-300;
+  double c = 1, d = 1 - (a + b) * x / (a + 1);
+  if (fabs(d) < tiny)
+    d = tiny;
+  d = 1 / d;
+  double h = d;
+  for (int m = 1; m <= 200; m++) {
+    double aa = m * (b - m) * x / ((a + 2 * m - 1) * (a + 2 * m));
+    d = 1 + aa * d;
+    c = 1 + aa / c;
+    d = 1 / (fabs(d) < tiny ? tiny : d);
+    c = fabs(c) < tiny ? tiny : c;
+    h *= d * c;
+    aa = -(a + m) * (a + b + m) * x / ((a + 2 * m) * (a + 2 * m + 1));
+    d = 1 + aa * d;
+    c = 1 + aa / c;
+    d = 1 / (fabs(d) < tiny ? tiny : d);
+    c = fabs(c) < tiny ? tiny : c;
+    double delta = d * c;
+    h *= delta;
+    if (fabs(delta - 1) < 1e-12)
+      break;
+  }
+  return h;
+}
+
+double incomplete_beta(double a, double b, double x) {
+  if (x <= 0)
+    return 0;
+  if (x >= 1)
+    return 1;
+  double front = exp(lgamma(a + b) - lgamma(a) - lgamma(b) + a * log(x) +
+                     b * log(1 - x));
+  if (x < (a + 1) / (a + b + 2))
+    return front * beta_fraction(a, b, x) / a;
+  return 1 - front * beta_fraction(b, a, 1 - x) / b;
+}
+
+// Two-sided p-value of Student's t with df degrees of freedom.
+double t_pvalue(double t, double df) {
+  return incomplete_beta(df / 2, 0.5, df / (df + t * t));
+}
+
+void print_usage() {
+  printf("Usage: bench_compare [options] <base.json> <new.json>\n");
+  printf("Options:\n");
+  printf("  -a <alpha>  Significance level (default: 0.05)\n");
+  printf("  -m <pct>    Ignore changes smaller than this (default: 2)\n");
+  printf("  -h          Show help\n");
+  printf("Exits with 1 when a row got significantly slower or the result\n");
+  printf("fingerprints differ.\n");
+}
+
+int main(int argc, char **argv) {
+  double alpha = 0.05;
+  double min_change = 2;
+
+  int i;
+  for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+    if (strcmp(argv[i], "-a") == 0 && i + 1 < argc) {
+      alpha = atof(argv[++i]);
+    } else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+      min_change = atof(argv[++i]);
+    } else if (strcmp(argv[i], "-h") == 0) {
+      print_usage();
+      return 0;
+    } else {
+      fprintf(stderr, "Unknown option: %s\n", argv[i]);
+      print_usage();
+      return 2;
+    }
+  }
+  if (argc - i != 2) {
+    print_usage();
+    return 2;
+  }
+
+  static Row base[MAX_ROWS], cur[MAX_ROWS];
+  char *base_text = read_file(argv[i]);
+  char *new_text = read_file(argv[i + 1]);
+  if (!base_text || !new_text)
+    return 2;
+  int num_base = parse_rows(base_text, base);
+  int num_new = parse_rows(new_text, cur);
+  char base_digest[17], new_digest[17];
+  int differ = scan_fingerprints(base_text, base_digest) +
+               scan_fingerprints(new_text, new_digest);
+  free(base_text);
+  free(new_text);
+  if (!num_base || !num_new) {
+    fprintf(stderr, "Error: No benchmark times found, were the files written "
+                    "with -b --json?\n");
+    return 2;
+  }
+
+  // Faster is no use if the counts changed.
+  if (differ)
+    printf("Error: Rows within a file have different result fingerprints\n");
+  if (base_digest[0] && new_digest[0] && strcmp(base_digest, new_digest)) {
+    printf("Error: Result fingerprint changed from %s to %s\n", base_digest,
+           new_digest);
+    differ++;
+  }
+
+  int regressions = 0;
+  printf("%-16s %10s %10s %8s %7s %6s %8s  %s\n", "Method", "Base (s)",
+         "New (s)", "Change", "t", "df", "p", "Verdict");
+  for (int r = 0; r < num_new; r++) {
+    const Row *n = &cur[r], *b = NULL;
+    for (int k = 0; k < num_base && !b; k++)
+      if (strcmp(base[k].label, n->label) == 0)
+        b = &base[k];
+    if (!b) {
+      printf("%-16s %10s %10.4f  (not in base)\n", n->label, "-", n->mean);
+      continue;
+    }
+
+    double change = (n->mean - b->mean) / b->mean * 100;
+    double se2 = b->var / b->n + n->var / n->n;
+    if (b->n < 2 || n->n < 2 || se2 <= 0) {
+      printf("%-16s %10.4f %10.4f %+7.1f%% %7s %6s %8s  needs 2+ reps\n",
+             n->label, b->mean, n->mean, change, "-", "-", "-");
+      continue;
+    }
+    // Welch-Satterthwaite degrees of freedom.
+    double t = (n->mean - b->mean) / sqrt(se2);
+    double vb = b->var / b->n, vn = n->var / n->n;
+    double df =
+        se2 * se2 / (vb * vb / (b->n - 1) + vn * vn / (n->n - 1));
+    double p = t_pvalue(t, df);
+
+    const char *verdict = "no change";
+    if (p < alpha && fabs(change) >= min_change) {
+      verdict = change > 0 ? "REGRESSION" : "improvement";
+      regressions += change > 0;
+    }
+    printf("%-16s %10.4f %10.4f %+7.1f%% %7.2f %6.1f %8.4f  %s\n", n->label,
+           b->mean, n->mean, change, t, df, p, verdict);
+  }
+
+  if (regressions)
+    printf("\n%d significant regression(s) at alpha %.3g\n", regressions,
+           alpha);
+  return regressions || differ ? 1 : 0;
+}
@@ -0,0 +1,315 @@
+// Microbenchmarks of the building blocks of wordfreq_omp, each timed alone:
+// delimiter scan, hash functions, insert_word(), merge_hashmaps() and the
+// sort in print_results(). Every case runs warm (caches left as the previous
+// repetition left them) and cold (caches flushed before each repetition).
+#define WORDFREQ_NO_MAIN
+#include "wordfreq_omp.c"
+
+#define REPS 5
+#define FLUSH_SIZE (64 << 20) // larger than the last level cache
+#define SCAN_SIZE (8 << 20)
+#define NUM_LOOKUPS 200000
+
+typedef struct {
+  const char *name;
+  void (*setup)(void *arg); // untimed, before every repetition
+  void (*run)(void *arg);
+  void (*teardown)(void *arg); // untimed, after every repetition
+  void *arg;
+  long ops; // operations done by one run
+} MicroBench;
+
+char *flush_buf;
+volatile unsigned long long sink; // keeps results from being optimized away
+uint64_t rng_state = 1;
+
+uint64_t next_random(void) {
+  uint64_t z = (rng_state += 0x9e3779b97f4a7c15ull);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
+
+void flush_caches(void) {
+  for (size_t i = 0; i < FLUSH_SIZE; i += CACHE_LINE)
+    flush_buf[i]++;
+}
+
+int next_word_id = 0; // across calls, so that no two lists share a word
+
+// Words of 5 to 10 letters: a random prefix of up to 5 letters and then the
+// word's id in 5 base 26 digits, which makes every word distinct.
+char **make_words(int n) {
+  char **words = malloc(n * sizeof(char *));
+  for (int i = 0; i < n; i++) {
+    int prefix = next_random() % 6;
+    words[i] = malloc(prefix + 6);
+    for (int j = 0; j < prefix; j++)
+      words[i][j] = 'a' + next_random() % 26;
+    for (int j = 4, id = next_word_id++; j >= 0; j--, id /= 26)
+      words[i][prefix + j] = 'a' + id % 26;
+    words[i][prefix + 5] = '\0';
+  }
+  return words;
+}
+
+void free_words(char **words, int n) {
+  for (int i = 0; i < n; i++)
+    free(words[i]);
+  free(words);
+}
+
+int compare_ns(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+// Median ns per operation over REPS repetitions.
+double time_bench(MicroBench *b, int cold) {
+  double ns[REPS];
+  for (int r = 0; r < REPS; r++) {
+    if (b->setup)
+      b->setup(b->arg);
+    if (cold)
+      flush_caches();
+    double start = omp_get_wtime();
+    b->run(b->arg);
+    ns[r] = (omp_get_wtime() - start) * 1e9 / b->ops;
+    if (b->teardown)
+      b->teardown(b->arg);
+  }
+  qsort(ns, REPS, sizeof(double), compare_ns);
+  return ns[REPS / 2];
+}
+
+void report(MicroBench *b) {
+  double warm = time_bench(b, 0);
+  double cold = time_bench(b, 1);
+  printf("| %-36s | %9ld | %10.2f | %10.2f |\n", b->name, b->ops, warm, cold);
+}
+
+// Delimiter scan: finding word breaks in a buffer, per byte.
+typedef struct {
+  char *buf;
+} ScanArg;
+
+void run_scan(void *arg) {
+  ScanArg *a = arg;
+  unsigned long long breaks = 0;
+  for (size_t i = 0; i < SCAN_SIZE; i++)
+    breaks += is_word_break(a->buf[i], " ,.!?;:");
+  sink = breaks;
+}
+
+// Hash variants, per word.
+typedef struct {
+  char **words;
+  int n;
+  unsigned int (*fn)(const char *word, int size);
+} HashArg;
+
+// The same FNV-1a without case folding, to price tolower().
+unsigned int hash_fnv1a_raw(const char *word, int size) {
+  unsigned int h = 2166136261u;
+  while (*word) {
+    h ^= (unsigned char)*word++;
+    h *= 16777619u;
+  }
+  return h % size;
+}
+
+// Folds ASCII letters with a bit operation instead of tolower().
+unsigned int hash_fnv1a_fold(const char *word, int size) {
+  unsigned int h = 2166136261u;
+  while (*word) {
+    unsigned char c = *word++;
+    h ^= c - 'A' < 26u ? c | 0x20 : c;
+    h *= 16777619u;
+  }
+  return h % size;
+}
+
+unsigned int hash_djb2(const char *word, int size) {
+  unsigned int h = 5381;
+  while (*word)
+    h = h * 33 + (unsigned char)tolower(*word++);
+  return h % size;
+}
+
+void run_hash(void *arg) {
+  HashArg *a = arg;
+  unsigned int h = 0;
+  for (int i = 0; i < a->n; i++)
+    h += a->fn(a->words[i], HASH_TABLE_SIZE);
+  sink = h;
+}
+
+// insert_word() into a map that holds vocab words: hits lookups find one of
+// them, the rest insert new words. Per insert_word() call.
+typedef struct {
+  char **vocab;
+  int vocab_size;
+  char **fresh; // words not in the vocabulary
+  char **stream;
+  int hit_percent;
+  HashMap *map;
+} InsertArg;
+
+void setup_insert(void *arg) {
+  InsertArg *a = arg;
+  a->map = create_hashmap(HASH_TABLE_SIZE);
+  for (int i = 0; i < a->vocab_size; i++)
+    insert_word(a->map, a->vocab[i]);
+}
+
+void run_insert(void *arg) {
+  InsertArg *a = arg;
+  for (int i = 0; i < NUM_LOOKUPS; i++)
+    insert_word(a->map, a->stream[i]);
+}
+
+void teardown_insert(void *arg) {
+  InsertArg *a = arg;
+  free_hashmap(a->map);
+}
+
+// merge_hashmaps() of a map of n words into one sharing half of them, per
+// source word.
+typedef struct {
+  char **words;
+  int n;
+  HashMap *src;
+  HashMap *dest;
+} MergeArg;
+
+void setup_merge(void *arg) {
+  MergeArg *a = arg;
+  a->src = create_hashmap(HASH_TABLE_SIZE);
+  a->dest = create_hashmap(HASH_TABLE_SIZE);
+  for (int i = 0; i < a->n; i++)
+    insert_word(a->src, a->words[i]);
+  for (int i = a->n / 2; i < a->n + a->n / 2; i++)
+    insert_word(a->dest, a->words[i]);
+}
+
+void run_merge(void *arg) {
+  MergeArg *a = arg;
+  merge_hashmaps(a->dest, a->src);
+}
+
+void teardown_merge(void *arg) {
+  MergeArg *a = arg;
+  free_hashmap(a->src);
+  free_hashmap(a->dest);
+}
+
+// print_results() of a map of n words, output discarded, per word.
+typedef struct {
+  HashMap *map;
+  int devnull;
+  int saved_stdout;
+} SortArg;
+
+void setup_sort(void *arg) {
+  SortArg *a = arg;
+  fflush(stdout);
+  a->saved_stdout = dup(STDOUT_FILENO);
+  dup2(a->devnull, STDOUT_FILENO);
+}
+
+void run_sort(void *arg) {
+  SortArg *a = arg;
+  print_results(a->map, 10, 1);
+  fflush(stdout);
+}
+
+void teardown_sort(void *arg) {
+  SortArg *a = arg;
+  dup2(a->saved_stdout, STDOUT_FILENO);
+  close(a->saved_stdout);
+}
+
+int main(void) {
+  const int vocab_sizes[] = {1000, 100000, 300000};
+  const int hit_percents[] = {100, 90, 50};
+  const int merge_sizes[] = {1000, 10000, 100000};
+  const int sort_sizes[] = {10000, 100000, 300000};
+  const int max_words = 500000;
+  char name[64];
+
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  flush_buf = calloc(FLUSH_SIZE, 1);
+  char **words = make_words(max_words);
+  char **fresh = make_words(NUM_LOOKUPS);
+
+  printf("Microbenchmarks (median of %d runs, ns per op):\n", REPS);
+  printf("-----------------------------------------------------------------"
+         "-----------\n");
+  printf("| %-36s | %9s | %10s | %10s |\n", "Benchmark", "Ops", "Warm",
+         "Cold");
+  printf("-----------------------------------------------------------------"
+         "-----------\n");
+
+  ScanArg scan = {malloc(SCAN_SIZE)};
+  for (size_t i = 0; i < SCAN_SIZE; i++)
+    scan.buf[i] = i % 6 == 5 ? " ,.\n"[next_random() % 4]
+                             : 'a' + next_random() % 26;
+  report(&(MicroBench){"delimiter scan (per byte)", NULL, run_scan, NULL,
+                       &scan, SCAN_SIZE});
+  free(scan.buf);
+
+  struct {
+    const char *name;
+    unsigned int (*fn)(const char *, int);
+  } hashes[] = {{"hash fnv1a tolower (current)", hash},
+                {"hash fnv1a no case folding", hash_fnv1a_raw},
+                {"hash fnv1a ascii fold", hash_fnv1a_fold},
+                {"hash djb2 tolower", hash_djb2}};
+  for (int h = 0; h < 4; h++) {
+    HashArg arg = {words, max_words, hashes[h].fn};
+    report(&(MicroBench){hashes[h].name, NULL, run_hash, NULL, &arg,
+                         max_words});
+  }
+
+  char **stream = malloc(NUM_LOOKUPS * sizeof(char *));
+  for (int v = 0; v < 3; v++) {
+    for (int p = 0; p < 3; p++) {
+      InsertArg arg = {words, vocab_sizes[v], fresh, stream, hit_percents[p]};
+      for (int i = 0; i < NUM_LOOKUPS; i++)
+        stream[i] = (int)(next_random() % 100) < arg.hit_percent
+                        ? words[next_random() % arg.vocab_size]
+                        : fresh[i];
+      snprintf(name, sizeof(name), "insert_word vocab %d, %d%% hits",
+               vocab_sizes[v], hit_percents[p]);
+      report(&(MicroBench){name, setup_insert, run_insert, teardown_insert,
+                           &arg, NUM_LOOKUPS});
+    }
+  }
+  free(stream);
+
+  for (int m = 0; m < 3; m++) {
+    MergeArg arg = {words, merge_sizes[m]};
+    snprintf(name, sizeof(name), "merge_hashmaps %d words", merge_sizes[m]);
+    report(&(MicroBench){name, setup_merge, run_merge, teardown_merge, &arg,
+                         merge_sizes[m]});
+  }
+
+  for (int s = 0; s < 3; s++) {
+    SortArg arg = {create_hashmap(HASH_TABLE_SIZE),
+                   open("/dev/null", O_WRONLY)};
+    for (int i = 0; i < sort_sizes[s]; i++)
+      insert_word(arg.map, words[i]);
+    snprintf(name, sizeof(name), "print_results %d words", sort_sizes[s]);
+    report(&(MicroBench){name, setup_sort, run_sort, teardown_sort, &arg,
+                         sort_sizes[s]});
+    close(arg.devnull);
+    free_hashmap(arg.map);
+  }
+
+  printf("-----------------------------------------------------------------"
+         "-----------\n");
+  free_words(words, max_words);
+  free_words(fresh, NUM_LOOKUPS);
+  free(flush_buf);
+  return 0;
+}
@@ -0,0 +1,184 @@
+#!/bin/sh
+# Differential test of every engine: each input set is counted by all OpenMP
+# engines and readers, from stdin and by wordfreq_mpi, and every run must
+# produce the same top words and result fingerprint as the sync engine.
+# Times go to check_timings.txt; a run much slower than the median of its
+# set is flagged, which does not fail the check.
+
+dir=check_data
+top_n=10
+slow=3 # flag runs slower than this times the median of the set
+quick=0
+mpirun=${MPIRUN:-mpirun --oversubscribe}
+
+usage() {
+  echo "Usage: check.sh [-q] [-d <dir>]"
+  echo "  -q        Skip test_files/, only small and edge case inputs"
+  echo "  -d <dir>  Where to generate inputs (default: check_data)"
+  echo "Set MPIRUN to change the launcher (default: mpirun --oversubscribe)"
+}
+
+while getopts "qd:h" opt; do
+  case $opt in
+  q) quick=1 ;;
+  d) dir=$OPTARG ;;
+  h)
+    usage
+    exit 0
+    ;;
+  *)
+    usage
+    exit 1
+    ;;
+  esac
+done
+
+for bin in ./wordfreq_omp ./wordfreq_mpi ./gen_corpus; do
+  if [ ! -x $bin ]; then
+    echo "Error: $bin not built, run make first" >&2
+    exit 1
+  fi
+done
+
+# Input sets, one directory each.
+rm -rf "$dir"
+mkdir -p "$dir/edge"
+./gen_corpus -f 4 -s 1M --seed 3 "$dir/zipf" >/dev/null &&
+  ./gen_corpus -f 3 -s 512K -V 2000 --crlf --mixed-case 0.5 --seed 5 \
+    "$dir/crlf_mixed" >/dev/null &&
+  ./gen_corpus -f 2 -s 256K -V 500 --min-len 90 --mean-len 105 \
+    --max-len 160 -L 0 --seed 9 "$dir/long_words" >/dev/null || exit 1
+
+: >"$dir/edge/empty.txt"
+printf 'alpha beta gamma' >"$dir/edge/no_trailing.txt"
+printf 'Alpha BETA\r\ngamma beta\r\nalpha\r\n' >"$dir/edge/crlf.txt"
+printf 'Word word WORD wOrD Word.word' >"$dir/edge/mixed_case.txt"
+# Words around MAX_WORD_LEN, and one longer than a READ_SIZE chunk, so that
+# the pipeline and steal engines cut it.
+awk 'BEGIN {
+  for (r = 0; r < 3; r++)
+    for (n = 98; n <= 102; n++) {
+      w = ""
+      for (i = 0; i < n; i++)
+        w = w "x"
+      printf "%s ", w
+    }
+  for (i = 0; i < 1100000; i++)
+    printf "y"
+}' >"$dir/edge/long.txt"
+
+sets="$dir/edge $dir/zipf $dir/crlf_mixed $dir/long_words"
+[ $quick = 1 ] || sets="$sets test_files"
+
+# Engines as name and options; "stdin", "fifo_*" and "mpi-N" are run
+# differently. fifo_* runs read the inputs through named pipes, which cannot
+# be read at an offset.
+engines="sync:--engine_sync files:-n_4 keep_order:-n_3_--keep-order
+pipeline_read:--io_read_-n_4 pipeline_pread:--io_pread_--readers_2_-n_4
+pipeline_uring:--io_uring_-n_4 steal:--engine_steal_-n_4
+direct_io:--direct-io_-n_4 fifo_pread:--io_pread_--readers_2_-n_4
+fifo_uring:--io_uring_-n_4 fifo_steal:--engine_steal_-n_4 stdin:-n_4 mpi-1
+mpi-3"
+
+out=$(mktemp -d)
+trap 'rm -rf "$out"' EXIT
+timings=check_timings.txt
+: >$timings
+failures=0
+
+# Makes a named pipe per input file in fifo_files, each fed by a background
+# cat whose pid goes to fifo_pids.
+make_fifos() {
+  rm -f "$out"/fifo_*
+  fifo_files=""
+  k=0
+  for f in $files; do
+    k=$((k + 1))
+    mkfifo "$out/fifo_$k"
+    cat "$f" >"$out/fifo_$k" &
+    echo $! >>"$out/fifo_pids"
+    fifo_files="$fifo_files $out/fifo_$k"
+  done
+}
+
+# Top words as lowercase "word count" lines, and the fingerprint line.
+summarize() {
+  awk -F'|' '/^\|/ && $3 ~ /[0-9]/ { gsub(/ /, ""); print tolower($2), $3 }
+    /^Fingerprint:/ { print }'
+}
+
+for set in $sets; do
+  files=$(ls "$set"/*.txt)
+  printf '%s:\n' "$set"
+  for e in $engines; do
+    name=${e%%:*}
+    opts=$(echo "${e#*:}" | tr _ ' ')
+    case $name in
+    stdin)
+      for f in $files; do
+        cat "$f"
+        echo
+      done | ./wordfreq_omp $opts -r -t $top_n --fingerprint - >"$out/raw"
+      ;;
+    fifo_*)
+      make_fifos
+      ./wordfreq_omp $opts -r -t $top_n --fingerprint $fifo_files >"$out/raw"
+      status=$?
+      # Writers of pipes that were never opened would block forever.
+      kill $(cat "$out/fifo_pids") 2>/dev/null
+      (exit $status)
+      ;;
+    mpi-*)
+      $mpirun -np "${name#mpi-}" ./wordfreq_mpi --fingerprint $files \
+        >"$out/raw"
+      ;;
+    *)
+      ./wordfreq_omp $opts -r -t $top_n --fingerprint $files >"$out/raw"
+      ;;
+    esac
+    status=$?
+    summarize <"$out/raw" >"$out/$name"
+    seconds=$(awk '/^(Execution|Processing) time:/ { print $3 }' "$out/raw")
+    echo "$set $name ${seconds:-0}" >>$timings
+
+    result=ok
+    if [ $status -ne 0 ]; then
+      result="FAILED (exit $status)"
+    elif [ $name != sync ] && ! cmp -s "$out/sync" "$out/$name"; then
+      result="FAILED (differs from sync)"
+      diff "$out/sync" "$out/$name" | sed 's/^/      /' | head -20
+    elif ! grep -q '^Fingerprint:' "$out/$name"; then
+      result="FAILED (no fingerprint)"
+    fi
+    case $result in
+    FAILED*) failures=$((failures + 1)) ;;
+    esac
+    printf '  %-16s %10s s  %s\n' "$name" "${seconds:-?}" "$result"
+  done
+done
+
+# Runs over 10 ms that take more than slow times their set's median.
+echo
+awk -v slow=$slow '{ t[$1] = t[$1] " " $3; row[NR] = $0 }
+  END {
+    for (s in t) {
+      n = split(substr(t[s], 2), v, " ")
+      for (i = 1; i <= n; i++)
+        for (j = i + 1; j <= n; j++)
+          if (v[j] < v[i]) { x = v[i]; v[i] = v[j]; v[j] = x }
+      median[s] = n % 2 ? v[(n + 1) / 2] : (v[n / 2] + v[n / 2 + 1]) / 2
+    }
+    for (r = 1; r <= NR; r++) {
+      split(row[r], f, " ")
+      if (f[3] > 0.01 && f[3] > slow * median[f[1]])
+        printf "Slow: %s on %s took %.3f s, median %.3f s\n", f[2], f[1],
+               f[3], median[f[1]]
+    }
+  }' $timings
+echo "Timings written to $timings"
+
+if [ $failures -gt 0 ]; then
+  echo "$failures run(s) FAILED"
+  exit 1
+fi
+echo "All engines agree"
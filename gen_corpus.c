@@ -0,0 +1,303 @@
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+// Writes text files whose word frequencies follow a Zipf distribution. The
+// same options and seed always produce the same files.
+
+typedef struct {
+  int files;
+  unsigned long long size; // bytes per file
+  int vocab;
+  double zipf;
+  int min_len;
+  int max_len;
+  double mean_len;
+  const char *delimiters;
+  int line_len; // 0 for a single line
+  int crlf;
+  double mixed_case; // fraction of words written with random case
+  uint64_t seed;
+} CorpusOptions;
+
+uint64_t rng_state;
+
+// splitmix64: small, fast and the same on every platform.
+uint64_t next_random(void) {
+  uint64_t z = (rng_state += 0x9e3779b97f4a7c15ull);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
+
+// Uniform in [0, 1).
+double next_uniform(void) { return (next_random() >> 11) * 0x1.0p-53; }
+
+// Word lengths are min_len plus a Poisson count, so most words are close to
+// the mean with a tail of longer ones, capped at max_len.
+int next_word_len(const CorpusOptions *opt) {
+  double lambda = opt->mean_len - opt->min_len;
+  int len = opt->min_len;
+  if (lambda > 0) {
+    double limit = exp(-lambda), p = next_uniform();
+    while (p > limit && len < opt->max_len) {
+      p *= next_uniform();
+      len++;
+    }
+  }
+  return len;
+}
+
+uint64_t hash_word(const char *word) {
+  uint64_t h = 14695981039346656037ull;
+  while (*word) {
+    h ^= (unsigned char)*word++;
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+// Distinct words, so that every rank of the Zipf distribution is its own word
+// and -V is the real vocabulary size. Duplicates are redrawn, found through
+// an open-addressing set of the words drawn so far.
+char **make_vocabulary(const CorpusOptions *opt) {
+  size_t slots = 1;
+  while (slots < 2 * (size_t)opt->vocab)
+    slots <<= 1;
+  char **words = malloc(opt->vocab * sizeof(char *));
+  char **set = calloc(slots, sizeof(char *));
+  if (!words || !set) {
+    fprintf(stderr, "Memory allocation error\n");
+    exit(1);
+  }
+  for (int i = 0; i < opt->vocab; i++) {
+    for (int tries = 0;; tries++) {
+      if (tries == 1000) {
+        fprintf(stderr, "Error: Cannot draw %d distinct words of %d to %d "
+                        "letters\n",
+                opt->vocab, opt->min_len, opt->max_len);
+        exit(1);
+      }
+      int len = next_word_len(opt);
+      words[i] = malloc(len + 1);
+      if (!words[i]) {
+        fprintf(stderr, "Memory allocation error\n");
+        exit(1);
+      }
+      for (int j = 0; j < len; j++)
+        words[i][j] = 'a' + next_random() % 26;
+      words[i][len] = '\0';
+
+      size_t slot = hash_word(words[i]) & (slots - 1);
+      while (set[slot] && strcmp(set[slot], words[i]) != 0)
+        slot = (slot + 1) & (slots - 1);
+      if (!set[slot]) {
+        set[slot] = words[i];
+        break;
+      }
+      free(words[i]);
+    }
+  }
+  free(set);
+  return words;
+}
+
+// cdf[k] is the probability of drawing one of the k + 1 most frequent words.
+double *make_zipf_cdf(int vocab, double s) {
+  double *cdf = malloc(vocab * sizeof(double));
+  if (!cdf) {
+    fprintf(stderr, "Memory allocation error\n");
+    exit(1);
+  }
+  double sum = 0;
+  for (int k = 0; k < vocab; k++)
+    cdf[k] = (sum += pow(k + 1, -s));
+  for (int k = 0; k < vocab; k++)
+    cdf[k] /= sum;
+  return cdf;
+}
+
+int draw_rank(const double *cdf, int vocab) {
+  double u = next_uniform();
+  int lo = 0, hi = vocab - 1;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (cdf[mid] < u)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+int write_file(const char *path, const CorpusOptions *opt, char **words,
+               const double *cdf) {
+  FILE *f = fopen(path, "w");
+  if (!f) {
+    perror(path);
+    return -1;
+  }
+
+  int num_delims = strlen(opt->delimiters);
+  unsigned long long written = 0;
+  int line = 0;
+  while (written < opt->size) {
+    const char *word = words[draw_rank(cdf, opt->vocab)];
+    int len = strlen(word);
+    if (opt->mixed_case > 0 && next_uniform() < opt->mixed_case) {
+      for (int j = 0; j < len; j++)
+        fputc(next_random() & 1 ? toupper(word[j]) : word[j], f);
+    } else {
+      fputs(word, f);
+    }
+    written += len;
+    line += len;
+
+    if (opt->line_len > 0 && line >= opt->line_len) {
+      fputs(opt->crlf ? "\r\n" : "\n", f);
+      written += opt->crlf ? 2 : 1;
+      line = 0;
+    } else if (num_delims > 0) {
+      fputc(opt->delimiters[next_random() % num_delims], f);
+      written++;
+      line++;
+    }
+  }
+
+  if (fclose(f) != 0) {
+    perror(path);
+    return -1;
+  }
+  return 0;
+}
+
+// Parses sizes such as 512K, 64MB or 1GB.
+unsigned long long parse_size(const char *arg) {
+  char *end;
+  unsigned long long size = strtoull(arg, &end, 10);
+  switch (toupper(*end)) {
+  case 'K':
+    size <<= 10;
+    end++;
+    break;
+  case 'M':
+    size <<= 20;
+    end++;
+    break;
+  case 'G':
+    size <<= 30;
+    end++;
+    break;
+  }
+  if (toupper(*end) == 'B')
+    end++;
+  return *end ? 0 : size;
+}
+
+void print_usage() {
+  printf("Usage: gen_corpus [options] <output-dir>\n");
+  printf("Options:\n");
+  printf("  -f <num>          Number of files (default: 4)\n");
+  printf("  -s <size>         Size of each file, e.g. 64M (default: 16M)\n");
+  printf("  -V <num>          Vocabulary size (default: 50000)\n");
+  printf("  -z <exp>          Zipf exponent (default: 1.0)\n");
+  printf("  --min-len <num>   Shortest word (default: 1)\n");
+  printf("  --max-len <num>   Longest word (default: 20)\n");
+  printf("  --mean-len <num>  Mean word length (default: 5)\n");
+  printf("  -d <delims>       Characters between words, repeat one to make\n");
+  printf("                    it more frequent (default: \" ,.!?;:\")\n");
+  printf("  -L <num>          Line length, 0 for one line (default: 80)\n");
+  printf("  --crlf            End lines with \\r\\n\n");
+  printf("  --mixed-case <p>  Fraction of words in random case (default: 0)\n");
+  printf("  --seed <num>      Random seed (default: 1)\n");
+  printf("  -h                Show help\n");
+}
+
+int main(int argc, char **argv) {
+  CorpusOptions opt = {.files = 4,
+                       .size = 16 << 20,
+                       .vocab = 50000,
+                       .zipf = 1.0,
+                       .min_len = 1,
+                       .max_len = 20,
+                       .mean_len = 5,
+                       .delimiters = " ,.!?;:",
+                       .line_len = 80,
+                       .seed = 1};
+
+  int i;
+  for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+    int has_arg = i + 1 < argc;
+    if (strcmp(argv[i], "-f") == 0 && has_arg) {
+      opt.files = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-s") == 0 && has_arg) {
+      opt.size = parse_size(argv[++i]);
+    } else if (strcmp(argv[i], "-V") == 0 && has_arg) {
+      opt.vocab = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-z") == 0 && has_arg) {
+      opt.zipf = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--min-len") == 0 && has_arg) {
+      opt.min_len = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--max-len") == 0 && has_arg) {
+      opt.max_len = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--mean-len") == 0 && has_arg) {
+      opt.mean_len = atof(argv[++i]);
+    } else if (strcmp(argv[i], "-d") == 0 && has_arg) {
+      opt.delimiters = argv[++i];
+    } else if (strcmp(argv[i], "-L") == 0 && has_arg) {
+      opt.line_len = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--crlf") == 0) {
+      opt.crlf = 1;
+    } else if (strcmp(argv[i], "--mixed-case") == 0 && has_arg) {
+      opt.mixed_case = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--seed") == 0 && has_arg) {
+      opt.seed = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-h") == 0) {
+      print_usage();
+      return 0;
+    } else {
+      fprintf(stderr, "Unknown option: %s\n", argv[i]);
+      print_usage();
+      return 1;
+    }
+  }
+
+  if (i != argc - 1) {
+    print_usage();
+    return 1;
+  }
+  if (opt.files <= 0 || opt.size == 0 || opt.vocab <= 0 || opt.min_len <= 0 ||
+      opt.max_len < opt.min_len || opt.mean_len < opt.min_len) {
+    fprintf(stderr, "Error: Invalid corpus options\n");
+    return 1;
+  }
+
+  const char *dir = argv[i];
+  if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+    perror(dir);
+    return 1;
+  }
+
+  rng_state = opt.seed;
+  char **words = make_vocabulary(&opt);
+  double *cdf = make_zipf_cdf(opt.vocab, opt.zipf);
+
+  for (int f = 0; f < opt.files; f++) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/corpus_%d.txt", dir, f + 1);
+    if (write_file(path, &opt, words, cdf) < 0)
+      return 1;
+    printf("Wrote %s\n", path);
+  }
+
+  for (int w = 0; w < opt.vocab; w++)
+    free(words[w]);
+  free(words);
+  free(cdf);
+  return 0;
+}
@@ -0,0 +1,121 @@
+#!/bin/sh
+# Strong and weak scaling of wordfreq_omp and wordfreq_mpi.
+#
+# Strong scaling counts the same corpus with 1, 2, 4, ... P threads or ranks.
+# Weak scaling gives every thread or rank one file of the same size, so the
+# corpus grows with P. Times are the median of the repetitions.
+#
+# Efficiency is speedup / P, where the weak speedup is P * T1 / TP. The
+# Karp-Flatt metric (1/S - 1/P) / (1 - 1/P) estimates the serial fraction;
+# if it grows with P the overhead grows too, not only the serial part.
+
+max_p=$(nproc 2>/dev/null || echo 4)
+reps=3
+weak_size=16M
+corpus=corpus
+mpirun=${MPIRUN:-mpirun --oversubscribe}
+
+usage() {
+  echo "Usage: scaling.sh [-p <max>] [-r <reps>] [-s <size>] [-c <dir>]"
+  echo "  -p <max>   Largest thread and rank count (default: nproc)"
+  echo "  -r <reps>  Runs per point, the median is kept (default: 3)"
+  echo "  -s <size>  Weak scaling file size per worker (default: 16M)"
+  echo "  -c <dir>   Strong scaling corpus from make corpus (default: corpus)"
+  echo "Set MPIRUN to change the launcher (default: mpirun --oversubscribe)"
+}
+
+while getopts "p:r:s:c:h" opt; do
+  case $opt in
+  p) max_p=$OPTARG ;;
+  r) reps=$OPTARG ;;
+  s) weak_size=$OPTARG ;;
+  c) corpus=$OPTARG ;;
+  h)
+    usage
+    exit 0
+    ;;
+  *)
+    usage
+    exit 1
+    ;;
+  esac
+done
+
+for bin in ./wordfreq_omp ./wordfreq_mpi ./gen_corpus; do
+  if [ ! -x $bin ]; then
+    echo "Error: $bin not built, run make first" >&2
+    exit 1
+  fi
+done
+if ! ls "$corpus"/*.txt >/dev/null 2>&1; then
+  echo "Error: No corpus in $corpus, run make corpus first" >&2
+  exit 1
+fi
+
+# 1, 2, 4, ... and max_p itself.
+counts=""
+p=1
+while [ $p -lt "$max_p" ]; do
+  counts="$counts $p"
+  p=$((p * 2))
+done
+counts="$counts $max_p"
+
+weak_dir="$corpus/weak"
+rm -rf "$weak_dir"
+./gen_corpus -f "$max_p" -s "$weak_size" --seed 7 "$weak_dir" >/dev/null ||
+  exit 1
+
+# The first n weak scaling files.
+weak_files() {
+  i=1
+  while [ $i -le "$1" ]; do
+    printf '%s ' "$weak_dir/corpus_$i.txt"
+    i=$((i + 1))
+  done
+}
+
+median() {
+  sort -g | awk '{ t[NR] = $1 }
+    END { print NR % 2 ? t[(NR + 1) / 2] : (t[NR / 2] + t[NR / 2 + 1]) / 2 }'
+}
+
+# Seconds of one point: binary, worker count, files.
+time_point() {
+  bin=$1
+  p=$2
+  shift 2
+  r=0
+  while [ $r -lt "$reps" ]; do
+    if [ "$bin" = omp ]; then
+      ./wordfreq_omp -n "$p" "$@" | awk '/^Execution time:/ { print $3 }'
+    else
+      $mpirun -np "$p" ./wordfreq_mpi "$@" |
+        awk '/^Processing time:/ { print $3 }'
+    fi
+    r=$((r + 1))
+  done | median
+}
+
+printf '%-6s %-4s %5s %10s %9s %6s %11s\n' Mode Bin P "Time (s)" Speedup \
+  Eff. Karp-Flatt
+echo "------------------------------------------------------------"
+for mode in strong weak; do
+  for bin in omp mpi; do
+    t1=""
+    for p in $counts; do
+      if [ $mode = strong ]; then
+        t=$(time_point $bin "$p" "$corpus"/*.txt)
+      else
+        t=$(time_point $bin "$p" $(weak_files "$p"))
+      fi
+      [ -z "$t1" ] && t1=$t
+      awk -v mode=$mode -v bin=$bin -v p="$p" -v t="$t" -v t1="$t1" 'BEGIN {
+        s = mode == "strong" ? t1 / t : p * t1 / t
+        kf = p > 1 ? sprintf("%.4f", (1 / s - 1 / p) / (1 - 1 / p)) : "-"
+        printf "%-6s %-4s %5d %10.4f %9.3f %6.2f %11s\n", mode, bin, p, t,
+               s, s / p, kf
+      }'
+    done
+  done
+done
@@ -1,16 +1,79 @@
 #include <ctype.h>
+#include <math.h>
 #include <mpi.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/utsname.h>
+#include <time.h>
 #include <unistd.h>
 
 #define MAX_WORD_LEN 100
 #define HASH_TABLE_SIZE 16384     // Larger for better distribution
 #define MAX_BUFFER_SIZE (1 << 26) // 64MB max buffer
 #define CHUNK_SIZE 8192           // File read chunk size
+#define CHAIN_HIST 9 // --table-stats chain lengths 0 to 7, and 8 or more
+#define TRACE_EVENTS 65536 // --trace ring size per rank, oldest dropped
+
+// Event ids of --trace; the same binary runs on every rank, so ranks send
+// ids rather than names.
+enum {
+    TRACE_FILE,
+    TRACE_MERGE,
+    TRACE_SERIALIZE,
+    TRACE_DESERIALIZE,
+    TRACE_BCAST,
+    TRACE_GATHER,
+    TRACE_GATHERV,
+    NUM_TRACE_KINDS
+};
+
+const char *trace_names[NUM_TRACE_KINDS] = {
+    "file", "merge", "serialize", "deserialize",
+    "MPI_Bcast", "MPI_Gather", "MPI_Gatherv"};
+
+// Steps of one count timed by -b, reduced over the ranks.
+enum {
+    TIME_DISTRIBUTE, // broadcasting the file names
+    TIME_COUNT,
+    TIME_LOCAL_MERGE, // merging each file's map into the rank's map
+    TIME_SERIALIZE,
+    TIME_EXCHANGE, // MPI_Gather of the lengths and MPI_Gatherv of the maps
+    TIME_DESERIALIZE,
+    TIME_GLOBAL_MERGE,
+    TIME_TOTAL,
+    NUM_TIMES
+};
+
+const char *time_names[NUM_TIMES] = {
+    "distribute", "count", "local_merge", "serialize",
+    "exchange", "deserialize", "global_merge", "total"};
 
 int verbose = 0;
+int count_df = 0;
+int show_table_stats = 0;
+int tracing = 0;
+int mem_stats = 0;
+int show_fingerprint = 0;
+unsigned long long mallocs = 0, frees = 0; // map allocations of this rank
+unsigned long long bytes_read = 0, tokens_read = 0; // input of this rank
+double phase_times[NUM_TIMES]; // of this rank's last count
+
+enum { MEM_COUNT, MEM_MERGE, NUM_MEM_PHASES };
+
+// What one map takes and the map allocations of its rank, see --mem-stats.
+// Sent as raw bytes like TableStats.
+typedef struct {
+  int rank; // -1 for the merged map
+  int items;
+  long peak_rss_kb;
+  unsigned long long node_bytes; // words are stored inline in the nodes
+  unsigned long long bucket_bytes;
+  unsigned long long mallocs, frees;
+  unsigned long long phase_mallocs[NUM_MEM_PHASES];
+  unsigned long long phase_frees[NUM_MEM_PHASES];
+} MemStats;
 #define LOG(rank, fmt, ...)                                                    \
   do {                                                                         \
     if (verbose)                                                               \
@@ -20,6 +83,8 @@ int verbose = 0;
 typedef struct WordNode {
   char word[MAX_WORD_LEN];
   int count;
+  int df;       // number of documents the word occurs in
+  int last_doc; // id of the last document that contained the word
   struct WordNode *next;
 } WordNode;
 
@@ -27,12 +92,66 @@ typedef struct {
   WordNode **buckets;
   int size;
   int items;
+  int doc; // document id stamped on words inserted into this map
+  unsigned long long lookups;
+  unsigned long long probes; // chain nodes compared by all lookups
 } HashMap;
 
+// Shape of one map and the cost of finding words in it. Sent as raw bytes,
+// all ranks run the same binary.
+typedef struct {
+  int rank; // -1 for the merged map
+  int buckets;
+  int items;
+  int used; // non-empty buckets
+  int max_chain;
+  unsigned long long lookups;
+  unsigned long long probes;
+  int hist[CHAIN_HIST];
+} TableStats;
+
+// Sums over runs of the per-run minimum, mean and maximum over the ranks.
+typedef struct {
+  double min[NUM_TIMES];
+  double avg[NUM_TIMES];
+  double max[NUM_TIMES];
+} PhaseSpread;
+
+typedef struct {
+  double median;
+  double min;
+  double mean;
+  double stddev;
+} RunTimes;
+
+// What one rank counted, for --json. Sent as raw bytes like TableStats.
+typedef struct {
+  int rank;
+  int files;
+  int items;
+  unsigned long long bytes;
+  unsigned long long tokens;
+  double busy; // seconds counting files and merging them into the rank's map
+  char host[MPI_MAX_PROCESSOR_NAME];
+} RankStats;
+
+typedef struct {
+  double start; // seconds since trace_origin
+  double end;
+  int kind;
+  int arg; // file index, -1 if none
+} TraceEvent;
+
+TraceEvent *trace_events = NULL;
+int num_trace_events = 0; // total added, only the last TRACE_EVENTS are kept
+double trace_origin;
+
 HashMap *create_hashmap(int size);
 void free_hashmap(HashMap *map);
 void insert_word(HashMap *map, const char *word);
-HashMap *process_file(const char *filename, const char *delims, int rank);
+void merge_word(HashMap *map, const char *word, int count, int df);
+HashMap *process_file(const char *filename, const char *delims, int doc,
+                      int rank);
 void serialize_hashmap(HashMap *map, char **buffer, int *length, int rank);
 void deserialize_hashmap(HashMap *map, const char *buffer, int length,
                          int rank);
@@ -47,6 +166,14 @@ unsigned int hash(const char *word, int size) {
   return h % size;
 }
 
+// Counts the map's mallocs and frees of this rank, see --mem-stats.
+void count_allocs(int new_mallocs, int new_frees) {
+  if (mem_stats) {
+    mallocs += new_mallocs;
+    frees += new_frees;
+  }
+}
+
 HashMap *create_hashmap(int size) {
   HashMap *map = malloc(sizeof(HashMap));
   if (!map) {
@@ -61,36 +188,100 @@ HashMap *create_hashmap(int size) {
   }
   map->size = size;
   map->items = 0;
+  map->doc = 0;
+  map->lookups = 0;
+  map->probes = 0;
+  count_allocs(2, 0);
   return map;
 }
 
 void free_hashmap(HashMap *map) {
   if (!map)
     return;
+  for (int i = 0; i < map->size; i++) {
+    WordNode *node = map->buckets[i];
+    while (node) {
+      WordNode *next = node->next;
+      free(node);
+      node = next;
+    }
+  }
+  count_allocs(0, map->items + 2);
   free(map->buckets);
   free(map);
 }
 
+// Counts a lookup that compared probes chain nodes, see --table-stats.
+void count_lookup(HashMap *map, int probes) {
+  if (show_table_stats) {
+    map->lookups++;
+    map->probes += probes;
+  }
+}
+
 void insert_word(HashMap *map, const char *word) {
   unsigned int h = hash(word, map->size);
   WordNode *node = map->buckets[h];
+  int probes = 0;
 
   while (node) {
+    probes++;
     if (strncasecmp(node->word, word, MAX_WORD_LEN) == 0) {
       node->count++;
+      if (node->last_doc != map->doc) {
+        node->last_doc = map->doc;
+        node->df++;
+      }
+      count_lookup(map, probes);
       return;
     }
     node = node->next;
   }
+  count_lookup(map, probes);
 
   node = malloc(sizeof(WordNode));
 
   strncpy(node->word, word, MAX_WORD_LEN - 1);
   node->word[MAX_WORD_LEN - 1] = '\0';
   node->count = 1;
+  node->df = 1;
+  node->last_doc = map->doc;
   node->next = map->buckets[h];
   map->buckets[h] = node;
   map->items++;
+  count_allocs(1, 0);
+}
+
+// Adds count occurrences spread over df documents. Callers merge maps built
+// from disjoint sets of documents, so document frequencies simply add up.
+void merge_word(HashMap *map, const char *word, int count, int df) {
+  unsigned int h = hash(word, map->size);
+  WordNode *node = map->buckets[h];
+  int probes = 0;
+
+  while (node) {
+    probes++;
+    if (strncasecmp(node->word, word, MAX_WORD_LEN) == 0) {
+      node->count += count;
+      node->df += df;
+      count_lookup(map, probes);
+      return;
+    }
+    node = node->next;
+  }
+  count_lookup(map, probes);
+
+  node = malloc(sizeof(WordNode));
+
+  strncpy(node->word, word, MAX_WORD_LEN - 1);
+  node->word[MAX_WORD_LEN - 1] = '\0';
+  node->count = count;
+  node->df = df;
+  node->last_doc = -1;
+  node->next = map->buckets[h];
+  map->buckets[h] = node;
+  map->items++;
+  count_allocs(1, 0);
 }
 
 int is_delimiter(char c, const char *delims) {
@@ -101,7 +292,8 @@ int is_delimiter(char c, const char *delims) {
   return 0;
 }
 
-HashMap *process_file(const char *filename, const char *delims, int rank) {
+HashMap *process_file(const char *filename, const char *delims, int doc,
+                      int rank) {
   LOG(rank, "Opening file %s", filename);
   FILE *file = fopen(filename, "r");
   if (!file) {
@@ -110,6 +302,7 @@ HashMap *process_file(const char *filename, const char *delims, int rank) {
   }
 
   HashMap *map = create_hashmap(HASH_TABLE_SIZE);
+  map->doc = doc;
   char *buffer = malloc(CHUNK_SIZE);
   char word[MAX_WORD_LEN];
   int word_len = 0;
@@ -124,12 +317,14 @@ HashMap *process_file(const char *filename, const char *delims, int rank) {
   size_t bytes;
   while ((bytes = fread(buffer, 1, CHUNK_SIZE - 1, file)) > 0) {
     buffer[bytes] = '\0';
+    bytes_read += bytes;
     for (size_t i = 0; i < bytes; i++) {
       char c = buffer[i];
       if (is_delimiter(c, delims) || c == '\n' || c == '\r') {
         if (word_len > 0) {
           word[word_len] = '\0';
           insert_word(map, word);
+          tokens_read++;
           word_len = 0;
         }
       } else if (word_len < MAX_WORD_LEN - 1) {
@@ -141,6 +336,7 @@ HashMap *process_file(const char *filename, const char *delims, int rank) {
   if (word_len > 0) {
     word[word_len] = '\0';
     insert_word(map, word);
+    tokens_read++;
   }
 
   if (ferror(file)) {
@@ -157,14 +353,36 @@ HashMap *process_file(const char *filename, const char *delims, int rank) {
   return map;
 }
 
+// Hash of one (lowercased word, count) pair, the same as in wordfreq_omp.
+unsigned long long pair_hash(const char *word, int count) {
+  unsigned long long h = 14695981039346656037ull;
+  while (*word) {
+    h ^= (unsigned char)(tolower(*word++));
+    h *= 1099511628211ull;
+  }
+  h += (unsigned long long)count * 0x9e3779b97f4a7c15ull;
+  h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+  h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+  return h ^ (h >> 31);
+}
+
+// Order-independent digest of the counts, equal to wordfreq_omp's for the
+// same results.
+unsigned long long fingerprint(HashMap *map) {
+  unsigned long long sum = 0;
+  for (int i = 0; i < map->size; i++)
+    for (WordNode *n = map->buckets[i]; n; n = n->next)
+      sum += pair_hash(n->word, n->count);
+  return sum;
+}
+
 void merge_hashmaps(HashMap *dest, HashMap *src) {
   if (!src)
     return;
   for (int i = 0; i < src->size; i++) {
     WordNode *node = src->buckets[i];
     while (node) {
-      for (int j = 0; j < node->count; j++)
-        insert_word(dest, node->word);
+      merge_word(dest, node->word, node->count, node->df);
       node = node->next;
     }
   }
@@ -172,7 +390,7 @@ void merge_hashmaps(HashMap *dest, HashMap *src) {
 
 void serialize_hashmap(HashMap *map, char **buffer, int *length, int rank) {
   LOG(rank, "Starting serialization, items: %d", map->items);
-  *length = map->items * (MAX_WORD_LEN + 12);
+  *length = map->items * (MAX_WORD_LEN + 24);
   if (*length > MAX_BUFFER_SIZE) {
     LOG(rank, "Buffer size %d exceeds max %d", *length, MAX_BUFFER_SIZE);
     free_hashmap(map);
@@ -191,8 +409,8 @@ void serialize_hashmap(HashMap *map, char **buffer, int *length, int rank) {
   for (int i = 0; i < map->size; i++) {
     WordNode *node = map->buckets[i];
     while (node) {
-      int len =
-          snprintf(ptr, *length - written, "%s:%d\n", node->word, node->count);
+      int len = snprintf(ptr, *length - written, "%s:%d:%d\n", node->word,
+                         node->count, node->df);
       if (len < 0 || written + len >= *length) {
         LOG(rank, "Buffer overflow during serialization, written: %d, len: %d",
             written, len);
@@ -230,17 +448,319 @@ void deserialize_hashmap(HashMap *map, const char *buffer, int length,
     char *colon = strchr(line, ':');
     if (colon) {
       *colon = '\0';
-      int count = atoi(colon + 1);
-      if (count > 0) {
-        for (int i = 0; i < count; i++)
-          insert_word(map, line);
-      }
+      char *end;
+      int count = strtol(colon + 1, &end, 10);
+      int df = *end == ':' ? atoi(end + 1) : 1;
+      if (count > 0)
+        merge_word(map, line, count, df);
     }
     line = strtok(NULL, "\n");
   }
   free(copy);
 }
 
+void get_table_stats(HashMap *map, int rank, TableStats *st) {
+  memset(st, 0, sizeof(*st));
+  st->rank = rank;
+  st->buckets = map->size;
+  st->items = map->items;
+  st->lookups = map->lookups;
+  st->probes = map->probes;
+  for (int i = 0; i < map->size; i++) {
+    int chain = 0;
+    for (WordNode *node = map->buckets[i]; node; node = node->next)
+      chain++;
+    st->used += chain > 0;
+    if (chain > st->max_chain)
+      st->max_chain = chain;
+    st->hist[chain < CHAIN_HIST - 1 ? chain : CHAIN_HIST - 1]++;
+  }
+}
+
+void print_table_stats(TableStats *stats, int n) {
+  char label[32];
+  printf("\nHash table stats:\n");
+  printf("  %-12s %8s %9s %7s %9s %10s %13s\n", "Map", "Buckets", "Items",
+         "Load", "Max chain", "Mean chain", "Probes/lookup");
+  for (int m = 0; m < n; m++) {
+    TableStats *st = &stats[m];
+    if (st->rank < 0)
+      strcpy(label, "global");
+    else
+      snprintf(label, sizeof(label), "rank %d", st->rank);
+    printf("  %-12s %8d %9d %7.3f %9d %10.3f %13.3f\n", label, st->buckets,
+           st->items, (double)st->items / st->buckets, st->max_chain,
+           st->used ? (double)st->items / st->used : 0,
+           st->lookups ? (double)st->probes / st->lookups : 0);
+  }
+
+  printf("\nBuckets by chain length:\n  %-12s", "Map");
+  for (int c = 0; c < CHAIN_HIST; c++)
+    printf(" %7d%s", c, c == CHAIN_HIST - 1 ? "+" : " ");
+  printf("\n");
+  for (int m = 0; m < n; m++) {
+    if (stats[m].rank < 0)
+      strcpy(label, "global");
+    else
+      snprintf(label, sizeof(label), "rank %d", stats[m].rank);
+    printf("  %-12s", label);
+    for (int c = 0; c < CHAIN_HIST; c++)
+      printf(" %7d ", stats[m].hist[c]);
+    printf("\n");
+  }
+}
+
+// Returns the seconds since start, so that callers can also time the step.
+double trace_add(int kind, double start, int arg) {
+  double end = MPI_Wtime();
+  if (!tracing)
+    return end - start;
+  if (!trace_events &&
+      !(trace_events = malloc(TRACE_EVENTS * sizeof(TraceEvent)))) {
+    LOG(0, "Failed to allocate trace buffer");
+    MPI_Abort(MPI_COMM_WORLD, 1);
+  }
+  TraceEvent *ev = &trace_events[num_trace_events++ % TRACE_EVENTS];
+  ev->start = start - trace_origin;
+  ev->end = end - trace_origin;
+  ev->kind = kind;
+  ev->arg = arg;
+  return end - start;
+}
+
+// Collects every rank's events on rank 0 and writes them there as Chrome
+// trace_event JSON, one process per rank.
+void write_trace(const char *path, int rank, int size) {
+  int count = num_trace_events < TRACE_EVENTS ? num_trace_events : TRACE_EVENTS;
+  int bytes = count * sizeof(TraceEvent);
+  // Put the ring in order, oldest first.
+  TraceEvent *mine = malloc(bytes ? bytes : 1);
+  for (int n = 0; n < count; n++)
+    mine[n] = trace_events[(num_trace_events - count + n) % TRACE_EVENTS];
+
+  int *lengths = NULL, *displs = NULL;
+  TraceEvent *all = NULL;
+  if (rank == 0) {
+    lengths = malloc(size * sizeof(int));
+    displs = malloc(size * sizeof(int));
+  }
+  MPI_Gather(&bytes, 1, MPI_INT, lengths, 1, MPI_INT, 0, MPI_COMM_WORLD);
+  if (rank == 0) {
+    int total = 0;
+    for (int r = 0; r < size; r++) {
+      displs[r] = total;
+      total += lengths[r];
+    }
+    all = malloc(total ? total : 1);
+  }
+  MPI_Gatherv(mine, bytes, MPI_BYTE, all, lengths, displs, MPI_BYTE, 0,
+              MPI_COMM_WORLD);
+  free(mine);
+  if (rank != 0)
+    return;
+
+  FILE *f = fopen(path, "w");
+  if (!f) {
+    perror(path);
+  } else {
+    fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    for (int r = 0; r < size; r++) {
+      fprintf(f,
+              "%s{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, "
+              "\"tid\": 0, \"args\": {\"name\": \"rank %d\"}}",
+              r ? ",\n" : "", r, r);
+      TraceEvent *ev = (TraceEvent *)((char *)all + displs[r]);
+      for (int n = 0; n < lengths[r] / (int)sizeof(TraceEvent); n++) {
+        fprintf(f,
+                ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": %d, "
+                "\"tid\": 0, \"ts\": %.3f, \"dur\": %.3f",
+                trace_names[ev[n].kind], r, ev[n].start * 1e6,
+                (ev[n].end - ev[n].start) * 1e6);
+        if (ev[n].arg >= 0)
+          fprintf(f, ", \"args\": {\"file\": %d}", ev[n].arg);
+        fprintf(f, "}");
+      }
+    }
+    fprintf(f, "\n]}\n");
+    fclose(f);
+  }
+  free(all);
+  free(lengths);
+  free(displs);
+}
+
+void get_mem_stats(HashMap *map, int rank, MemStats *st) {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  st->rank = rank;
+  st->items = map->items;
+  st->peak_rss_kb = usage.ru_maxrss;
+  st->node_bytes = (unsigned long long)map->items * sizeof(WordNode);
+  st->bucket_bytes = sizeof(HashMap) + map->size * sizeof(WordNode *);
+  st->mallocs = mallocs;
+  st->frees = frees;
+}
+
+// Charges the allocations since mallocs0 and frees0 to a phase.
+void mem_charge(MemStats *st, int phase, unsigned long long mallocs0,
+                unsigned long long frees0) {
+  st->phase_mallocs[phase] += mallocs - mallocs0;
+  st->phase_frees[phase] += frees - frees0;
+}
+
+void print_mem_stats(MemStats *stats, int n) {
+  const char *phases[NUM_MEM_PHASES] = {"count", "merge"};
+  printf("\nMemory by rank (words are stored inline in the nodes):\n");
+  printf("  %-8s %8s %8s %9s %10s %7s %15s", "Map", "Peak MB", "Words",
+         "Nodes MB", "Buckets MB", "B/word", "mallocs/frees");
+  for (int p = 0; p < NUM_MEM_PHASES; p++)
+    printf(" %15s", phases[p]);
+  printf("\n");
+  for (int m = 0; m < n; m++) {
+    MemStats *st = &stats[m];
+    char label[32], cell[48];
+    if (st->rank < 0)
+      strcpy(label, "global");
+    else
+      snprintf(label, sizeof(label), "rank %d", st->rank);
+    printf("  %-8s %8.1f %8d %9.2f %10.2f %7.1f", label,
+           st->peak_rss_kb / 1024.0, st->items, st->node_bytes / 1e6,
+           st->bucket_bytes / 1e6,
+           st->items ? (double)(st->node_bytes + st->bucket_bytes) / st->items
+                     : 0);
+    if (st->rank < 0) {
+      printf("\n");
+      continue;
+    }
+    snprintf(cell, sizeof(cell), "%llu/%llu", st->mallocs, st->frees);
+    printf(" %15s", cell);
+    for (int p = 0; p < NUM_MEM_PHASES; p++) {
+      snprintf(cell, sizeof(cell), "%llu/%llu", st->phase_mallocs[p],
+               st->phase_frees[p]);
+      printf(" %15s", cell);
+    }
+    printf("\n");
+  }
+}
+
+void write_json_string(FILE *f, const char *s) {
+  fputc('"', f);
+  for (; *s; s++) {
+    unsigned char c = *s;
+    if (c == '"' || c == '\\')
+      fprintf(f, "\\%c", c);
+    else if (c < 0x20)
+      fprintf(f, "\\u%04x", c);
+    else
+      fputc(c, f);
+  }
+  fputc('"', f);
+}
+
+int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+// Wall times are the slowest rank's total, sorted in place.
+RunTimes summarize_times(double *times, int n) {
+  RunTimes st = {0};
+  qsort(times, n, sizeof(double), compare_doubles);
+  st.min = times[0];
+  st.median = n % 2 ? times[n / 2] : (times[n / 2 - 1] + times[n / 2]) / 2;
+  for (int r = 0; r < n; r++)
+    st.mean += times[r] / n;
+  for (int r = 0; r < n && n > 1; r++)
+    st.stddev += (times[r] - st.mean) * (times[r] - st.mean) / (n - 1);
+  st.stddev = sqrt(st.stddev);
+  return st;
+}
+
+// Writes the runs on rank 0 in the layout of wordfreq_omp --json, so that
+// bench_compare can compare the two. times are the wall times of the runs.
+void write_json(const char *path, RankStats *ranks, int size, char **files,
+                int num_files, const char *delims, const double *times,
+                int reps, int warmup, const PhaseSpread *spread, int unique,
+                unsigned long long digest) {
+  FILE *f = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+  if (!f) {
+    perror(path);
+    return;
+  }
+  char date[32] = "";
+  struct utsname u;
+  time_t now = time(NULL);
+  if (uname(&u) != 0)
+    memset(&u, 0, sizeof(u));
+  strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+  unsigned long long bytes = 0, tokens = 0;
+  for (int r = 0; r < size; r++) {
+    bytes += ranks[r].bytes;
+    tokens += ranks[r].tokens;
+  }
+  double sorted[reps];
+  memcpy(sorted, times, sizeof(sorted));
+  RunTimes st = summarize_times(sorted, reps);
+
+  fprintf(f, "{\"tool\": \"wordfreq_mpi\", \"date\": \"%s\",", date);
+  fprintf(f, "\n \"host\": {\"hostname\": ");
+  write_json_string(f, ranks[0].host);
+  fprintf(f, ", \"os\": ");
+  write_json_string(f, u.sysname);
+  fprintf(f, ", \"kernel\": ");
+  write_json_string(f, u.release);
+  fprintf(f, ", \"machine\": ");
+  write_json_string(f, u.machine);
+  fprintf(f, ",\n  \"cpus\": %ld, \"compiler\": ",
+          sysconf(_SC_NPROCESSORS_ONLN));
+  write_json_string(f, __VERSION__);
+  fprintf(f, "},\n \"config\": {\"ranks\": %d, \"df\": %d, \"reps\": %d,",
+          size, count_df, reps);
+  fprintf(f, " \"warmup\": %d,", warmup);
+  fprintf(f, " \"delimiters\": ");
+  write_json_string(f, delims);
+  fprintf(f, ",\n  \"files\": [");
+  for (int i = 0; i < num_files; i++) {
+    fprintf(f, "%s", i ? ", " : "");
+    write_json_string(f, files[i]);
+  }
+  fprintf(f, "]},\n \"benchmark\": [\n");
+
+  fprintf(f, "{\"label\": \"MPI (%d)\", \"ranks\": %d, \"reps\": %d,", size,
+          size, reps);
+  fprintf(f, "\n \"times\": [");
+  for (int r = 0; r < reps; r++)
+    fprintf(f, "%s%.6f", r ? ", " : "", times[r]);
+  fprintf(f, "],\n \"median\": %.6f, \"min\": %.6f, \"mean\": %.6f,",
+          st.median, st.min, st.mean);
+  fprintf(f, " \"stddev\": %.6f,", st.stddev);
+  fprintf(f, "\n \"bytes\": %llu, \"tokens\": %llu, \"unique\": %d,",
+          bytes, tokens, unique);
+  fprintf(f, " \"fingerprint\": \"%016llx\",", digest);
+  fprintf(f, "\n \"throughput\": {\"mb_per_s\": %.2f, "
+             "\"mtokens_per_s\": %.3f, \"ns_per_token\": %.3f},",
+          bytes / 1e6 / st.median, tokens / 1e6 / st.median,
+          tokens ? st.median * 1e9 / tokens : 0);
+  fprintf(f, "\n \"phases\": {");
+  for (int p = 0; p < NUM_TIMES; p++)
+    fprintf(f, "%s\n  \"%s\": {\"min\": %.6f, \"avg\": %.6f, \"max\": %.6f}",
+            p ? "," : "", time_names[p], spread->min[p] / reps,
+            spread->avg[p] / reps, spread->max[p] / reps);
+  fprintf(f, "},");
+  fprintf(f, "\n \"per_rank\": [");
+  for (int r = 0; r < size; r++) {
+    fprintf(f, "%s\n  {\"rank\": %d, \"host\": ", r ? "," : "", r);
+    write_json_string(f, ranks[r].host);
+    fprintf(f, ", \"files\": %d, \"bytes\": %llu, \"tokens\": %llu,",
+            ranks[r].files, ranks[r].bytes, ranks[r].tokens);
+    fprintf(f, " \"words\": %d, \"busy_seconds\": %.6f}", ranks[r].items,
+            ranks[r].busy);
+  }
+  fprintf(f, "]}\n]}\n");
+  if (f != stdout)
+    fclose(f);
+}
+
 int compare_words(const void *a, const void *b) {
   WordNode *wa = (WordNode *)a;
   WordNode *wb = (WordNode *)b;
@@ -251,7 +771,7 @@ int compare_words(const void *a, const void *b) {
   return strncasecmp(wa->word, wb->word, MAX_WORD_LEN);
 }
 
-void print_results(HashMap *map, int top_n) {
+void print_results(HashMap *map, int top_n, int num_docs) {
   WordNode *words = malloc(map->items * sizeof(WordNode));
   int idx = 0;
 
@@ -261,6 +781,7 @@ void print_results(HashMap *map, int top_n) {
       strncpy(words[idx].word, current->word, MAX_WORD_LEN);
       words[idx].word[MAX_WORD_LEN - 1] = '\0';
       words[idx].count = current->count;
+      words[idx].df = current->df;
       idx++;
       current = current->next;
     }
@@ -269,18 +790,227 @@ void print_results(HashMap *map, int top_n) {
   qsort(words, map->items, sizeof(WordNode), compare_words);
 
   printf("\nTop %d words by frequency:\n", top_n);
-  printf("----------------------------\n");
-  printf("| %-16s | %-7s |\n", "Word", "Count");
-  printf("----------------------------\n");
+  if (count_df) {
+    printf("(document frequency over %d documents)\n", num_docs);
+    printf("--------------------------------------\n");
+    printf("| %-16s | %-7s | %-7s |\n", "Word", "Count", "DF");
+    printf("--------------------------------------\n");
+  } else {
+    printf("----------------------------\n");
+    printf("| %-16s | %-7s |\n", "Word", "Count");
+    printf("----------------------------\n");
+  }
 
   for (int i = 0; i < map->items && i < top_n; i++) {
-    printf("| %-16s | %-7d |\n", words[i].word, words[i].count);
+    if (count_df)
+      printf("| %-16s | %-7d | %-7d |\n", words[i].word, words[i].count,
+             words[i].df);
+    else
+      printf("| %-16s | %-7d |\n", words[i].word, words[i].count);
   }
-  printf("----------------------------\n");
+  if (count_df)
+    printf("--------------------------------------\n");
+  else
+    printf("----------------------------\n");
 
   free(words);
 }
 
+// One full count: rank 0 hands out the file names, every rank counts its
+// files, and rank 0 gathers the maps and merges them. Returns the merged map
+// on rank 0 and NULL elsewhere, *local is the rank's own map. Every step's
+// time on this rank goes to phase_times.
+HashMap *count_files(char **files, int num_files, const char *delims,
+                     int rank, int size, HashMap **local, MemStats *mem,
+                     RankStats *run) {
+  int max_filename_len = 256;
+  char *filename_buffer = NULL;
+  char **filenames = NULL;
+  int total_buffer_size;
+  double t;
+
+  memset(phase_times, 0, sizeof(phase_times));
+  bytes_read = tokens_read = 0;
+  double start_time = MPI_Wtime();
+  if (rank == 0) {
+    filenames = malloc(num_files * sizeof(char *));
+    total_buffer_size = num_files * max_filename_len;
+    filename_buffer = malloc(total_buffer_size * sizeof(char));
+    if (!filenames || !filename_buffer) {
+      LOG(0, "Failed to allocate filename buffers");
+      MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    char *ptr = filename_buffer;
+    for (int i = 0; i < num_files; i++) {
+      filenames[i] = ptr;
+      strncpy(ptr, files[i], max_filename_len - 1);
+      filenames[i][max_filename_len - 1] = '\0';
+      ptr += max_filename_len;
+    }
+  }
+
+  t = MPI_Wtime();
+  MPI_Bcast(&num_files, 1, MPI_INT, 0, MPI_COMM_WORLD);
+  trace_add(TRACE_BCAST, t, -1);
+
+  if (rank != 0) {
+    total_buffer_size = num_files * max_filename_len;
+    filename_buffer = malloc(total_buffer_size * sizeof(char));
+    filenames = malloc(num_files * sizeof(char *));
+    if (!filename_buffer || !filenames) {
+      LOG(rank, "Failed to allocate filename buffers");
+      MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    for (int i = 0; i < num_files; i++) {
+      filenames[i] = filename_buffer + i * max_filename_len;
+    }
+  }
+
+  t = MPI_Wtime();
+  MPI_Bcast(filename_buffer, total_buffer_size, MPI_CHAR, 0, MPI_COMM_WORLD);
+  trace_add(TRACE_BCAST, t, -1);
+  phase_times[TIME_DISTRIBUTE] = MPI_Wtime() - start_time;
+
+  *mem = (MemStats){0};
+  *run = (RankStats){rank};
+  HashMap *local_map = create_hashmap(HASH_TABLE_SIZE);
+  for (int i = rank; i < num_files; i += size) {
+    LOG(rank, "Assigned file: %s", filenames[i]);
+    t = MPI_Wtime();
+    unsigned long long mallocs0 = mallocs, frees0 = frees;
+    HashMap *tmp = process_file(filenames[i], delims, i, rank);
+    mem_charge(mem, MEM_COUNT, mallocs0, frees0);
+    phase_times[TIME_COUNT] += trace_add(TRACE_FILE, t, i);
+    if (tmp) {
+      t = MPI_Wtime();
+      mallocs0 = mallocs, frees0 = frees;
+      merge_hashmaps(local_map, tmp);
+      free_hashmap(tmp);
+      mem_charge(mem, MEM_MERGE, mallocs0, frees0);
+      phase_times[TIME_LOCAL_MERGE] += trace_add(TRACE_MERGE, t, i);
+    }
+    run->files++;
+  }
+  run->busy = phase_times[TIME_COUNT] + phase_times[TIME_LOCAL_MERGE];
+  *local = local_map;
+
+  free(filename_buffer);
+  free(filenames);
+
+  char *send_buffer;
+  int send_length;
+  t = MPI_Wtime();
+  serialize_hashmap(local_map, &send_buffer, &send_length, rank);
+  phase_times[TIME_SERIALIZE] = trace_add(TRACE_SERIALIZE, t, -1);
+
+  int *recv_lengths = NULL;
+  int *displs = NULL;
+  char *recv_buffer = NULL;
+  if (rank == 0) {
+    recv_lengths = malloc(size * sizeof(int));
+    displs = malloc(size * sizeof(int));
+    if (!recv_lengths || !displs) {
+      LOG(0, "Failed to allocate gather buffers");
+      free_hashmap(local_map);
+      free(send_buffer);
+      MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+  }
+
+  t = MPI_Wtime();
+  MPI_Gather(&send_length, 1, MPI_INT, recv_lengths, 1, MPI_INT, 0,
+             MPI_COMM_WORLD);
+  phase_times[TIME_EXCHANGE] = trace_add(TRACE_GATHER, t, -1);
+
+  if (rank == 0) {
+    int total_length = 0;
+    for (int i = 0; i < size; i++) {
+      displs[i] = total_length;
+      total_length += recv_lengths[i];
+    }
+    if (total_length > MAX_BUFFER_SIZE) {
+      LOG(0, "Total gathered size %d exceeds max %d", total_length,
+          MAX_BUFFER_SIZE);
+      free(recv_lengths);
+      free(displs);
+      free_hashmap(local_map);
+      free(send_buffer);
+      MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    recv_buffer = malloc(total_length);
+    if (!recv_buffer) {
+      LOG(0, "Failed to allocate receive buffer");
+      free(recv_lengths);
+      free(displs);
+      free_hashmap(local_map);
+      free(send_buffer);
+      MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+  }
+
+  t = MPI_Wtime();
+  MPI_Gatherv(send_buffer, send_length, MPI_CHAR, recv_buffer, recv_lengths,
+              displs, MPI_CHAR, 0, MPI_COMM_WORLD);
+  phase_times[TIME_EXCHANGE] += trace_add(TRACE_GATHERV, t, -1);
+  free(send_buffer);
+
+  HashMap *global_map = NULL;
+  if (rank == 0) {
+    unsigned long long mallocs0 = mallocs, frees0 = frees;
+    global_map = create_hashmap(HASH_TABLE_SIZE);
+    t = MPI_Wtime();
+    merge_hashmaps(global_map, local_map);
+    phase_times[TIME_GLOBAL_MERGE] = trace_add(TRACE_MERGE, t, -1);
+    for (int i = 1; i < size; i++) {
+      if (recv_lengths[i] > 0) {
+        t = MPI_Wtime();
+        deserialize_hashmap(global_map, recv_buffer + displs[i],
+                            recv_lengths[i], rank);
+        phase_times[TIME_DESERIALIZE] += trace_add(TRACE_DESERIALIZE, t, -1);
+      }
+    }
+    mem_charge(mem, MEM_MERGE, mallocs0, frees0);
+    free(recv_buffer);
+    free(recv_lengths);
+    free(displs);
+  }
+  phase_times[TIME_TOTAL] = MPI_Wtime() - start_time;
+  return global_map;
+}
+
+// Reduces this rank's phase_times of one run to their minimum, mean and
+// maximum over all ranks, and adds them to spread on rank 0.
+void reduce_phase_times(PhaseSpread *spread, int size) {
+  double min[NUM_TIMES], max[NUM_TIMES], sum[NUM_TIMES];
+  MPI_Reduce(phase_times, min, NUM_TIMES, MPI_DOUBLE, MPI_MIN, 0,
+             MPI_COMM_WORLD);
+  MPI_Reduce(phase_times, max, NUM_TIMES, MPI_DOUBLE, MPI_MAX, 0,
+             MPI_COMM_WORLD);
+  MPI_Reduce(phase_times, sum, NUM_TIMES, MPI_DOUBLE, MPI_SUM, 0,
+             MPI_COMM_WORLD);
+  for (int p = 0; p < NUM_TIMES; p++) {
+    spread->min[p] += min[p];
+    spread->avg[p] += sum[p] / size;
+    spread->max[p] += max[p];
+  }
+}
+
+// Phase times are per run, averaged over the runs. Only rank 0 deserializes
+// and merges, so there max against avg is the cost of the single root.
+void print_phase_spread(const PhaseSpread *spread, int reps, int size) {
+  printf("\nPhase times over %d rank(s), mean of %d run(s) (s):\n", size,
+         reps);
+  printf("  %-14s %10s %10s %10s %8s\n", "Phase", "Min", "Avg", "Max",
+         "Max/Avg");
+  for (int p = 0; p < NUM_TIMES; p++) {
+    double avg = spread->avg[p] / reps;
+    printf("  %-14s %10.4f %10.4f %10.4f %8.2f\n", time_names[p],
+           spread->min[p] / reps, avg, spread->max[p] / reps,
+           avg > 0 ? spread->max[p] / reps / avg : 0);
+  }
+}
+
 int main(int argc, char **argv) {
     MPI_Init(&argc, &argv);
     int rank, size;
@@ -288,134 +1018,191 @@ int main(int argc, char **argv) {
     MPI_Comm_rank(MPI_COMM_WORLD, &rank);
     MPI_Comm_size(MPI_COMM_WORLD, &size);
 
-    if (argc < 2) {
+    int first_file = 1;
+    const char *trace_path = NULL;
+    const char *json_path = NULL;
+    int run_bench = 0;
+    int reps = 5;
+    int warmup = 1;
+    for (; first_file < argc && argv[first_file][0] == '-'; first_file++) {
+        if (strcmp(argv[first_file], "--df") == 0) {
+            count_df = 1;
+        } else if (strcmp(argv[first_file], "--trace") == 0 &&
+                   first_file + 1 < argc) {
+            trace_path = argv[++first_file];
+            tracing = 1;
+        } else if (strcmp(argv[first_file], "--json") == 0 &&
+                   first_file + 1 < argc) {
+            json_path = argv[++first_file];
+        } else if (strcmp(argv[first_file], "--fingerprint") == 0) {
+            show_fingerprint = 1;
+        } else if (strcmp(argv[first_file], "-b") == 0) {
+            run_bench = 1;
+        } else if (strcmp(argv[first_file], "--reps") == 0 &&
+                   first_file + 1 < argc && atoi(argv[first_file + 1]) > 0) {
+            reps = atoi(argv[++first_file]);
+        } else if (strcmp(argv[first_file], "--warmup") == 0 &&
+                   first_file + 1 < argc && atoi(argv[first_file + 1]) >= 0) {
+            warmup = atoi(argv[++first_file]);
+        } else if (strcmp(argv[first_file], "--mem-stats") == 0) {
+            mem_stats = 1;
+        } else if (strcmp(argv[first_file], "--table-stats") == 0) {
+            show_table_stats = 1;
+        } else {
+            if (rank == 0)
+                fprintf(stderr, "Unknown option: %s\n", argv[first_file]);
+            MPI_Finalize();
+            return 1;
+        }
+    }
+
+    if (first_file >= argc) {
         if (rank == 0)
-            fprintf(stderr, "Usage: %s <file1> [file2 ...]\n", argv[0]);
+            fprintf(stderr,
+                    "Usage: %s [-b [--reps <num>] [--warmup <num>]] [--df] "
+                    "[--fingerprint]\n       [--table-stats] "
+                    "[--mem-stats] [--trace <file>] [--json <file>] "
+                    "<file1> [file2 ...]\n",
+                    argv[0]);
         MPI_Finalize();
         return 1;
     }
 
-    double start_time = MPI_Wtime();
-    int num_files = argc - 1;
-    int max_filename_len = 256;
-    char *filename_buffer = NULL;
-    char **filenames = NULL;
-    int total_buffer_size;
-
-    if (rank == 0) {
-        filenames = malloc(num_files * sizeof(char *));
-        total_buffer_size = num_files * max_filename_len;
-        filename_buffer = malloc(total_buffer_size * sizeof(char));
-        if (!filenames || !filename_buffer) {
-            LOG(0, "Failed to allocate filename buffers");
-            MPI_Abort(MPI_COMM_WORLD, 1);
-        }
-
-        char *ptr = filename_buffer;
-        for (int i = 0; i < num_files; i++) {
-            filenames[i] = ptr;
-            strncpy(ptr, argv[i + 1], max_filename_len - 1);
-            filenames[i][max_filename_len - 1] = '\0';
-            ptr += max_filename_len;
-        }
+    // Line the ranks' timelines up on a common start.
+    if (tracing) {
+        MPI_Barrier(MPI_COMM_WORLD);
+        trace_origin = MPI_Wtime();
     }
 
-    MPI_Bcast(&num_files, 1, MPI_INT, 0, MPI_COMM_WORLD);
-
-    if (rank != 0) {
-        total_buffer_size = num_files * max_filename_len;
-        filename_buffer = malloc(total_buffer_size * sizeof(char));
-        filenames = malloc(num_files * sizeof(char *));
-        if (!filename_buffer || !filenames) {
-            LOG(rank, "Failed to allocate filename buffers");
-            MPI_Abort(MPI_COMM_WORLD, 1);
+    int num_files = argc - first_file;
+    char **files = argv + first_file;
+    int runs = run_bench ? warmup + reps : 1;
+    if (!run_bench)
+        reps = 1;
+    double *times = malloc(reps * sizeof(double));
+    PhaseSpread spread = {0};
+    MemStats my_mem = {0}, global_mem = {0};
+    RankStats my_run;
+    HashMap *local_map = NULL, *global_map = NULL;
+    // Every benchmark run must count what the first one counted.
+    unsigned long long expected = 0;
+    int mismatches = 0;
+    for (int r = 0; r < runs; r++) {
+        if (r > 0) {
+            free_hashmap(local_map);
+            if (global_map)
+                free_hashmap(global_map);
         }
-        for (int i = 0; i < num_files; i++) {
-            filenames[i] = filename_buffer + i * max_filename_len;
+        if (run_bench)
+            MPI_Barrier(MPI_COMM_WORLD);
+        global_map = count_files(files, num_files, delims, rank, size,
+                                 &local_map, &my_mem, &my_run);
+        if (rank == 0 && run_bench) {
+            unsigned long long digest = fingerprint(global_map);
+            if (r == 0) {
+                expected = digest;
+            } else if (digest != expected) {
+                fprintf(stderr,
+                        "Error: Run %d result fingerprint %016llx differs "
+                        "from %016llx\n",
+                        r, digest, expected);
+                mismatches++;
+            }
         }
+        if (r < runs - reps)
+            continue;
+        if (run_bench || json_path)
+            reduce_phase_times(&spread, size);
+        // The slowest rank's total is the wall time of the run.
+        MPI_Reduce(&phase_times[TIME_TOTAL], &times[r - (runs - reps)], 1,
+                   MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
     }
 
-    MPI_Bcast(filename_buffer, total_buffer_size, MPI_CHAR, 0, MPI_COMM_WORLD);
-
-    HashMap *local_map = create_hashmap(HASH_TABLE_SIZE);
-    for (int i = rank; i < num_files; i += size) {
-        LOG(rank, "Assigned file: %s", filenames[i]);
-        HashMap *tmp = process_file(filenames[i], delims, rank);
-        if (tmp) {
-            merge_hashmaps(local_map, tmp);
-            free_hashmap(tmp);
-        }
+    // One row per rank, and one for the merged map on rank 0.
+    TableStats *table_stats = NULL;
+    if (show_table_stats) {
+        TableStats mine;
+        get_table_stats(local_map, rank, &mine);
+        if (rank == 0)
+            table_stats = malloc((size + 1) * sizeof(TableStats));
+        MPI_Gather(&mine, sizeof(TableStats), MPI_BYTE, table_stats,
+                   sizeof(TableStats), MPI_BYTE, 0, MPI_COMM_WORLD);
     }
 
-    free(filename_buffer);
-    free(filenames);
-
-    char *send_buffer;
-    int send_length;
-    serialize_hashmap(local_map, &send_buffer, &send_length, rank);
-
-    int *recv_lengths = NULL;
-    int *displs = NULL;
-    char *recv_buffer = NULL;
-    if (rank == 0) {
-        recv_lengths = malloc(size * sizeof(int));
-        displs = malloc(size * sizeof(int));
-        if (!recv_lengths || !displs) {
-            LOG(0, "Failed to allocate gather buffers");
-            free_hashmap(local_map);
-            free(send_buffer);
-            MPI_Abort(MPI_COMM_WORLD, 1);
-        }
+    RankStats *ranks = NULL;
+    if (json_path) {
+        int len;
+        MPI_Get_processor_name(my_run.host, &len);
+        my_run.items = local_map->items;
+        my_run.bytes = bytes_read;
+        my_run.tokens = tokens_read;
+        if (rank == 0)
+            ranks = malloc(size * sizeof(RankStats));
+        MPI_Gather(&my_run, sizeof(RankStats), MPI_BYTE, ranks,
+                   sizeof(RankStats), MPI_BYTE, 0, MPI_COMM_WORLD);
     }
 
-    MPI_Gather(&send_length, 1, MPI_INT, recv_lengths, 1, MPI_INT, 0, MPI_COMM_WORLD);
-
     if (rank == 0) {
-        int total_length = 0;
-        for (int i = 0; i < size; i++) {
-            displs[i] = total_length;
-            total_length += recv_lengths[i];
+        unsigned long long digest = fingerprint(global_map);
+        if (run_bench) {
+            double sorted[reps];
+            memcpy(sorted, times, sizeof(sorted));
+            RunTimes st = summarize_times(sorted, reps);
+            printf("MPI benchmark, %d rank(s), %d run(s), %d warmup:\n", size,
+                   reps, warmup);
+            printf("  Wall time: median %.4f s, min %.4f s, stddev %.4f s\n",
+                   st.median, st.min, st.stddev);
+            printf("  Result fingerprint: %016llx\n", digest);
+            if (mismatches)
+                printf("  %d run(s) differ from the first, see above\n",
+                       mismatches);
+            print_phase_spread(&spread, reps, size);
+        } else {
+            printf("Processing time: %f seconds\n", times[0]);
+            print_results(global_map, 10, num_files);
+            if (show_fingerprint)
+                printf("Fingerprint: %016llx\n", digest);
         }
-        if (total_length > MAX_BUFFER_SIZE) {
-            LOG(0, "Total gathered size %d exceeds max %d", total_length, MAX_BUFFER_SIZE);
-            free(recv_lengths);
-            free(displs);
-            free_hashmap(local_map);
-            free(send_buffer);
-            MPI_Abort(MPI_COMM_WORLD, 1);
+        if (ranks) {
+            write_json(json_path, ranks, size, files, num_files, delims,
+                       times, reps, warmup, &spread, global_map->items,
+                       digest);
+            free(ranks);
         }
-        recv_buffer = malloc(total_length);
-        if (!recv_buffer) {
-            LOG(0, "Failed to allocate receive buffer");
-            free(recv_lengths);
-            free(displs);
-            free_hashmap(local_map);
-            free(send_buffer);
-            MPI_Abort(MPI_COMM_WORLD, 1);
+        if (table_stats) {
+            get_table_stats(global_map, -1, &table_stats[size]);
+            print_table_stats(table_stats, size + 1);
+            free(table_stats);
         }
+        if (mem_stats)
+            get_mem_stats(global_map, -1, &global_mem);
+        free_hashmap(global_map);
     }
+    free(times);
 
-    MPI_Gatherv(send_buffer, send_length, MPI_CHAR, recv_buffer, recv_lengths, displs, MPI_CHAR, 0, MPI_COMM_WORLD);
-    free(send_buffer);
-
-    if (rank == 0) {
-        HashMap *global_map = create_hashmap(HASH_TABLE_SIZE);
-        merge_hashmaps(global_map, local_map);
-        for (int i = 1; i < size; i++) {
-            if (recv_lengths[i] > 0) {
-                deserialize_hashmap(global_map, recv_buffer + displs[i], recv_lengths[i], rank);
-            }
+    if (mem_stats) {
+        MemStats *all = NULL;
+        if (rank == 0)
+            all = malloc((size + 1) * sizeof(MemStats));
+        MemStats phases = my_mem;
+        get_mem_stats(local_map, rank, &my_mem);
+        memcpy(my_mem.phase_mallocs, phases.phase_mallocs,
+               sizeof(phases.phase_mallocs));
+        memcpy(my_mem.phase_frees, phases.phase_frees,
+               sizeof(phases.phase_frees));
+        MPI_Gather(&my_mem, sizeof(MemStats), MPI_BYTE, all, sizeof(MemStats),
+                   MPI_BYTE, 0, MPI_COMM_WORLD);
+        if (rank == 0) {
+            all[size] = global_mem;
+            print_mem_stats(all, size + 1);
+            free(all);
         }
-        double end_time = MPI_Wtime();
-        printf("Processing time: %f seconds\n", end_time - start_time);
-        print_results(global_map, 10);
-        free_hashmap(global_map);
-        free(recv_buffer);
-        free(recv_lengths);
-        free(displs);
     }
 
     free_hashmap(local_map);
+    if (trace_path)
+        write_trace(trace_path, rank, size);
+    free(trace_events);
     MPI_Finalize();
-    return 0;
-}
\ No newline at end of file
+    return mismatches ? 1 : 0;
+}
@@ -1,13 +1,110 @@
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
 #include <omp.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#define HAVE_IO_URING 1
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC 1
+#endif
+#if defined(__linux__) && __has_include(<linux/perf_event.h>)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#define HAVE_PERF_EVENTS 1
+#endif
 
 #define MAX_WORD_LEN 100
 #define HASH_TABLE_SIZE 16384
+#define READ_SIZE (1 << 20)          // File read size
+#define STREAM_READ_SIZE (64 << 20)  // Stdin read size, split across threads
+#define IO_ALIGN 4096                // O_DIRECT buffer and offset alignment
+#define BLOCK_HEADROOM IO_ALIGN      // Room for a word cut by the last read
+#define WINDOW_SLOTS 10              // Sub-windows in a --window ring
+#define DECAY_RESCALE 1048576.0      // Weight at which decayed scores rescale
+#define BLOCKS_PER_THREAD 4          // Pipeline buffers per pipeline thread
+#define BLOCK_BUF_SIZE (BLOCK_HEADROOM + READ_SIZE + IO_ALIGN)
+#define URING_DEPTH 32               // Extra buffers kept in flight by io_uring
+#define CACHE_LINE 64
+#define MAX_THREADS 256
+#define CHAIN_HIST 9 // --table-stats chain lengths 0 to 7, and 8 or more
+#define TRACE_EVENTS 65536 // --trace ring size per thread, oldest dropped
+
+enum { ENGINE_FILES, ENGINE_PIPELINE, ENGINE_STEAL, ENGINE_SYNC };
+const char *engine_names[] = {"files", "pipeline", "steal", "sync"};
+enum { IO_READ, IO_PREAD, IO_URING };
+const char *io_names[] = {"read", "pread", "uring"};
+enum {
+  PHASE_READ,
+  PHASE_TOKENIZE,
+  PHASE_INSERT,
+  PHASE_FILE_MERGE,   // merging a file's map into the thread's map
+  PHASE_GLOBAL_MERGE, // merging a thread's map into the result, with waiting
+  PHASE_SORT,
+  NUM_PHASES
+};
+
+const char *phase_names[NUM_PHASES] = {
+    "read", "tokenize", "insert", "file_merge", "global_merge", "sort"};
+
+enum {
+  PERF_CYCLES,
+  PERF_INSTRUCTIONS,
+  PERF_LLC_MISSES,
+  PERF_BRANCH_MISSES,
+  PERF_DTLB_MISSES,
+  NUM_PERF
+};
+
+// Trace events are the phases above plus these.
+enum { TRACE_FILE = NUM_PHASES, TRACE_WAIT, TRACE_STEAL, NUM_TRACE_KINDS };
+
+const char *trace_names[NUM_TRACE_KINDS] = {
+    "read",         "tokenize", "insert", "file_merge",
+    "global_merge", "sort",     "file",   "wait",
+    "steal"};
+
+const char *perf_names[NUM_PERF] = {"cycles", "instructions", "llc_misses",
+                                    "branch_misses", "dtlb_misses"};
 
 int verbose = 0;
+int count_df = 0;
+int engine = ENGINE_FILES;
+int num_readers = 1;
+int io_backend = IO_READ;
+int direct_io = 0;
+int keep_order = 0;
+int phase_timing = 0; // also time every insert_word() call
+int use_rdtsc = 0;
+int show_table_stats = 0;
+int perf_counters = 0;
+int tracing = 0;
+int mem_stats = 0;
+int show_fingerprint = 0;
+int cold_cache = 0; // benchmark also with the inputs evicted before each run
+unsigned long long last_fingerprint; // of the last map given to fingerprint()
 #define LOG(...)                                                               \
   do {                                                                         \
     if (verbose)                                                               \
@@ -18,28 +115,358 @@ typedef struct WordNode {
   char *word;
   int count;
   int hash;
+  int df;       // number of documents the word occurs in
+  int last_doc; // id of the last document that contained the word
+  double score; // exponentially decayed count, see stream_add()
   struct WordNode *next;
 } WordNode;
 
 typedef struct {
   char *word;
   int count;
+  int df;
 } WordFreq;
 
+typedef struct {
+  WordFreq *top; // best words of one file, words owned by the report
+  int count;
+  int items; // unique words in the file
+} FileReport;
+
+typedef struct {
+  int fd;
+  int eof;
+  int follow; // end of input is temporary, keep the cut word for later
+  char tail[MAX_WORD_LEN]; // start of the word cut by the end of the last read
+  int tail_len;
+  int partial; // return after the first read instead of filling the block
+  int direct;  // fd bypasses the page cache, reads must stay aligned
+  unsigned long long bytes;
+} BlockReader;
+
+// Filled by the thread with the same OpenMP thread number during a run.
+typedef struct {
+  double busy; // seconds spent reading and counting
+  double phase[NUM_PHASES];
+  unsigned long long cycles[NUM_PHASES]; // with --rdtsc
+  unsigned long long bytes;              // bytes tokenized
+  unsigned long long tokens;
+  unsigned long long new_words; // words added to the thread's maps
+  unsigned long long perf[NUM_PHASES][NUM_PERF]; // with --perf-counters
+  unsigned long long mallocs; // map allocations, see count_allocs()
+  unsigned long long frees;
+  unsigned long long phase_mallocs[NUM_PHASES];
+  unsigned long long phase_frees[NUM_PHASES];
+} __attribute__((aligned(CACHE_LINE))) ThreadStats;
+
+ThreadStats thread_stats[MAX_THREADS];
+int stats_threads = 0;
+
+// Shape of one map and the cost of finding words in it, see --table-stats.
+typedef struct {
+  char label[32];
+  int buckets;
+  int items;
+  int used; // non-empty buckets
+  int max_chain;
+  unsigned long long lookups;
+  unsigned long long probes;
+  int hist[CHAIN_HIST];
+} TableStats;
+
+TableStats *table_stats = NULL; // recorded during a run
+int num_table_stats = 0;
+
+typedef struct {
+  double seconds;
+  unsigned long long cycles;
+  unsigned long long perf[NUM_PERF];
+  unsigned long long mallocs;
+  unsigned long long frees;
+} Stamp;
+
+#ifdef HAVE_PERF_EVENTS
+// Counters count the OS thread that opened them, so every thread opens its
+// own group on first use and keeps it for the life of the thread.
+__thread int perf_group = -2; // -2: not opened yet, -1: unavailable
+__thread int perf_index[NUM_PERF]; // position in the group read, -1 if absent
+int perf_errors[NUM_PERF];         // errno of events that failed to open
+
+void perf_open_thread(void) {
+  const struct {
+    unsigned type;
+    unsigned long long config;
+  } events[NUM_PERF] = {
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+      {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL |
+                               PERF_COUNT_HW_CACHE_OP_READ << 8 |
+                               PERF_COUNT_HW_CACHE_RESULT_MISS << 16},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+      {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB |
+                               PERF_COUNT_HW_CACHE_OP_READ << 8 |
+                               PERF_COUNT_HW_CACHE_RESULT_MISS << 16}};
+  int n = 0;
+
+  perf_group = -1;
+  for (int e = 0; e < NUM_PERF; e++) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = events[e].type;
+    attr.config = events[e].config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    int fd = syscall(__NR_perf_event_open, &attr, 0, -1, perf_group, 0);
+    perf_index[e] = fd < 0 ? -1 : n++;
+    if (fd < 0)
+      perf_errors[e] = errno;
+    else if (perf_group < 0)
+      perf_group = fd;
+  }
+}
+#endif
+
+// Leaves zeros for counters that are not available.
+void perf_read(unsigned long long *values) {
+  memset(values, 0, NUM_PERF * sizeof(unsigned long long));
+#ifdef HAVE_PERF_EVENTS
+  if (!perf_counters)
+    return;
+  if (perf_group == -2)
+    perf_open_thread();
+  unsigned long long group[1 + NUM_PERF]; // nr, then one value per event
+  if (perf_group < 0 || read(perf_group, group, sizeof(group)) <= 0)
+    return;
+  for (int e = 0; e < NUM_PERF; e++)
+    if (perf_index[e] >= 0)
+      values[e] = group[1 + perf_index[e]];
+#endif
+}
+
+void reset_thread_stats(int threads) {
+  memset(thread_stats, 0, sizeof(thread_stats));
+  stats_threads = threads;
+  num_table_stats = 0;
+}
+
+typedef struct {
+  double start; // seconds since trace_origin
+  double end;
+  int kind;
+  int arg; // file index, -1 if none
+} TraceEvent;
+
+// Written only by the thread with the same OpenMP thread number, so adding
+// an event takes no lock. Once full, new events overwrite the oldest.
+typedef struct {
+  TraceEvent *events;
+  unsigned long long next;
+} __attribute__((aligned(CACHE_LINE))) TraceRing;
+
+TraceRing trace_rings[MAX_THREADS];
+double trace_origin;
+
+void trace_add(int kind, double start, double end, int arg) {
+  if (!tracing)
+    return;
+  TraceRing *ring = &trace_rings[omp_get_thread_num()];
+  if (!ring->events &&
+      !(ring->events = malloc(TRACE_EVENTS * sizeof(TraceEvent)))) {
+    fprintf(stderr, "Memory allocation error\n");
+    exit(1);
+  }
+  TraceEvent *ev = &ring->events[ring->next++ % TRACE_EVENTS];
+  ev->start = start - trace_origin;
+  ev->end = end - trace_origin;
+  ev->kind = kind;
+  ev->arg = arg;
+}
+
+// Writes the rings as Chrome trace_event JSON, one timeline per thread.
+int write_trace(const char *path) {
+  FILE *f = fopen(path, "w");
+  if (!f) {
+    perror(path);
+    return -1;
+  }
+  fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+  int first = 1;
+  for (int t = 0; t < MAX_THREADS; t++) {
+    TraceRing *ring = &trace_rings[t];
+    if (!ring->events)
+      continue;
+    fprintf(f,
+            "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, "
+            "\"tid\": %d, \"args\": {\"name\": \"thread %d\"}}",
+            first ? "" : ",\n", t, t);
+    first = 0;
+    unsigned long long from =
+        ring->next > TRACE_EVENTS ? ring->next - TRACE_EVENTS : 0;
+    for (unsigned long long n = from; n < ring->next; n++) {
+      TraceEvent *ev = &ring->events[n % TRACE_EVENTS];
+      fprintf(f,
+              ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 0, \"tid\": %d, "
+              "\"ts\": %.3f, \"dur\": %.3f",
+              trace_names[ev->kind], t, ev->start * 1e6,
+              (ev->end - ev->start) * 1e6);
+      if (ev->arg >= 0)
+        fprintf(f, ", \"args\": {\"file\": %d}", ev->arg);
+      fprintf(f, "}");
+    }
+    free(ring->events);
+    ring->events = NULL;
+  }
+  fprintf(f, "\n]}\n");
+  return fclose(f);
+}
+
+// Time and TSC only, cheap enough to take around every insert_word().
+Stamp clock_now(void) {
+  Stamp now = {omp_get_wtime(), 0, {0}};
+#ifdef HAVE_RDTSC
+  if (use_rdtsc)
+    now.cycles = __rdtsc();
+#endif
+  return now;
+}
+
+Stamp stamp_now(void) {
+  Stamp now = clock_now();
+  ThreadStats *ts = &thread_stats[omp_get_thread_num()];
+  perf_read(now.perf);
+  now.mallocs = ts->mallocs;
+  now.frees = ts->frees;
+  return now;
+}
+
+// Charges the time since start to a phase of the calling thread. Returns the
+// seconds charged.
+double phase_add(int phase, Stamp start) {
+  Stamp now = stamp_now();
+  ThreadStats *ts = &thread_stats[omp_get_thread_num()];
+  ts->phase[phase] += now.seconds - start.seconds;
+  ts->cycles[phase] += now.cycles - start.cycles;
+  for (int e = 0; e < NUM_PERF; e++)
+    ts->perf[phase][e] += now.perf[e] - start.perf[e];
+  ts->phase_mallocs[phase] += now.mallocs - start.mallocs;
+  ts->phase_frees[phase] += now.frees - start.frees;
+  trace_add(phase, start.seconds, now.seconds, -1);
+  return now.seconds - start.seconds;
+}
+
 typedef struct {
   WordNode **buckets;
   int size;
   int items;
+  int doc; // document id stamped on words inserted into this map
+  unsigned long long lookups;
+  unsigned long long probes; // chain nodes compared by all lookups
 } HashMap;
 
+// Words starting in [begin, end) of data are counted, see count_span().
+typedef struct {
+  char *buf; // BLOCK_BUF_SIZE bytes, recycled between files
+  char *data;
+  size_t len;
+  size_t begin;
+  size_t end;
+} Block;
+
+typedef struct {
+  int file;
+  off_t offset;
+  size_t len; // at most READ_SIZE
+} ReadTask;
+
+typedef struct {
+  _Atomic size_t seq;
+  Block *block;
+} QueueCell;
+
+// Bounded lock-free multi-producer multi-consumer queue (Vyukov). Each cell
+// carries a sequence number telling producers and consumers whose turn it is.
+typedef struct {
+  QueueCell *cells;
+  size_t mask;
+  char pad1[CACHE_LINE];
+  _Atomic size_t head;
+  char pad2[CACHE_LINE];
+  _Atomic size_t tail;
+  char pad3[CACHE_LINE];
+} BlockQueue;
+
+typedef struct {
+  Block *pool;
+  int pool_size;
+  BlockQueue free_blocks;
+  BlockQueue full_blocks;
+  char **filenames;
+  int *order; // file indices, see schedule_order()
+  int num_files;
+  const char *delimiters;
+  atomic_int next_file;
+  ReadTask *tasks; // fixed-size reads for the pread and io_uring readers
+  int num_tasks;
+  int *fds;
+  atomic_int next_task;
+  atomic_int readers_active;
+} Pipeline;
+
+// Work of one thread in the stealing engine: files not started yet, and the
+// unread byte range [next, end) of the file it is reading. The owner takes
+// chunks from the front of the range and files from the front of the list;
+// thieves take files from the back, or the back half of the range.
+typedef struct {
+  omp_lock_t lock;
+  int *files;
+  int head;
+  int tail;
+  int file; // -1 if no file is being read
+  off_t next;
+  off_t end;
+  char pad[CACHE_LINE];
+} WorkDeque;
+
+typedef struct {
+  double window;                // seconds covered by the ring, 0 if unused
+  HashMap *slots[WINDOW_SLOTS]; // counts of one sub-window each
+  long slot_epoch[WINDOW_SLOTS]; // sub-window a slot holds, -1 if empty
+  double half_life;             // seconds, 0 if unused
+  HashMap *decayed;             // scores relative to decay_base
+  double decay_base;
+} StreamCounts;
+
+// Counts the map's mallocs and frees for the calling thread, see --mem-stats.
+void count_allocs(int mallocs, int frees) {
+  if (!mem_stats)
+    return;
+  ThreadStats *ts = &thread_stats[omp_get_thread_num()];
+  ts->mallocs += mallocs;
+  ts->frees += frees;
+}
+
 HashMap *create_hashmap(int size) {
   HashMap *map = malloc(sizeof(HashMap));
   map->size = size;
   map->items = 0;
+  map->doc = 0;
+  map->lookups = 0;
+  map->probes = 0;
   map->buckets = calloc(size, sizeof(WordNode *));
+  count_allocs(2, 0);
   return map;
 }
 
+// Counts a lookup that compared probes chain nodes, see --table-stats.
+void count_lookup(HashMap *map, int probes) {
+  if (show_table_stats) {
+    map->lookups++;
+    map->probes += probes;
+  }
+}
+
 unsigned int hash(const char *word, int size) {
   unsigned int h = 2166136261u;
   while (*word) {
@@ -52,14 +479,22 @@ unsigned int hash(const char *word, int size) {
 void insert_word(HashMap *map, const char *word) {
   unsigned int h = hash(word, map->size);
   WordNode *current = map->buckets[h];
+  int probes = 0;
 
   while (current) {
+    probes++;
     if (strncasecmp(current->word, word, MAX_WORD_LEN) == 0) {
       current->count++;
+      if (current->last_doc != map->doc) {
+        current->last_doc = map->doc;
+        current->df++;
+      }
+      count_lookup(map, probes);
       return;
     }
     current = current->next;
   }
+  count_lookup(map, probes);
 
   WordNode *node = malloc(sizeof(WordNode));
   if (!node) {
@@ -69,10 +504,41 @@ void insert_word(HashMap *map, const char *word) {
 
   node->word = strdup(word);
   node->count = 1;
+  node->df = 1;
+  node->last_doc = map->doc;
+  node->score = 0;
   node->hash = h;
   node->next = map->buckets[h];
   map->buckets[h] = node;
   map->items++;
+  count_allocs(2, 0);
+}
+
+// Hash of one (lowercased word, count) pair: FNV-1a over 64 bits, with the
+// count mixed in by the splitmix64 finalizer.
+unsigned long long pair_hash(const char *word, int count) {
+  unsigned long long h = 14695981039346656037ull;
+  while (*word) {
+    h ^= (unsigned char)(tolower(*word++));
+    h *= 1099511628211ull;
+  }
+  h += (unsigned long long)count * 0x9e3779b97f4a7c15ull;
+  h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+  h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+  return h ^ (h >> 31);
+}
+
+// Sum of pair_hash() over all words: the same counts give the same value
+// whatever the table size, bucket order or case kept. wordfreq_mpi computes
+// it the same way.
+unsigned long long fingerprint(HashMap *map) {
+  unsigned long long sum = 0;
+#pragma omp parallel for reduction(+ : sum) schedule(static)
+  for (int i = 0; i < map->size; i++)
+    for (WordNode *n = map->buckets[i]; n; n = n->next)
+      sum += pair_hash(n->word, n->count);
+  last_fingerprint = sum;
+  return sum;
 }
 
 void merge_hashmaps(HashMap *dest, HashMap *src) {
@@ -82,15 +548,23 @@ void merge_hashmaps(HashMap *dest, HashMap *src) {
     while (current) {
       unsigned int h = hash(current->word, dest->size);
       WordNode *dest_node = dest->buckets[h];
-      int found = 0;
+      int found = 0, probes = 0;
 
       while (dest_node && !found) {
-        if (strcmp(dest_node->word, current->word) == 0) {
+        probes++;
+        if (strncasecmp(dest_node->word, current->word, MAX_WORD_LEN) == 0) {
           dest_node->count += current->count;
+          dest_node->score += current->score;
+          // Two maps that end on the same document share that document.
+          dest_node->df +=
+              current->df - (dest_node->last_doc == current->last_doc);
+          if (current->last_doc > dest_node->last_doc)
+            dest_node->last_doc = current->last_doc;
           found = 1;
         }
         dest_node = dest_node->next;
       }
+      count_lookup(dest, probes);
 
       if (!found) {
         WordNode *new_node = malloc(sizeof(WordNode));
@@ -99,10 +573,14 @@ void merge_hashmaps(HashMap *dest, HashMap *src) {
           exit(1);
         }
         new_node->count = current->count;
+        new_node->df = current->df;
+        new_node->last_doc = current->last_doc;
+        new_node->score = current->score;
         new_node->hash = current->hash;
         new_node->next = dest->buckets[h];
         dest->buckets[h] = new_node;
         dest->items++;
+        count_allocs(2, 0);
       }
 
       current = current->next;
@@ -110,7 +588,72 @@ void merge_hashmaps(HashMap *dest, HashMap *src) {
   }
 }
 
-void free_hashmap(HashMap *map) {
+WordNode *find_word(HashMap *map, const char *word) {
+  WordNode *current = map->buckets[hash(word, map->size)];
+  int probes = 0;
+  for (; current; current = current->next) {
+    probes++;
+    if (strncasecmp(current->word, word, MAX_WORD_LEN) == 0)
+      break;
+  }
+  count_lookup(map, probes);
+  return current;
+}
+
+// Appends the shape of map to table_stats under label.
+void record_table_stats(HashMap *map, const char *label, int id) {
+  TableStats st = {.buckets = map->size,
+                   .items = map->items,
+                   .lookups = map->lookups,
+                   .probes = map->probes};
+  snprintf(st.label, sizeof(st.label), label, id);
+  for (int i = 0; i < map->size; i++) {
+    int chain = 0;
+    for (WordNode *current = map->buckets[i]; current; current = current->next)
+      chain++;
+    st.used += chain > 0;
+    if (chain > st.max_chain)
+      st.max_chain = chain;
+    st.hist[chain < CHAIN_HIST - 1 ? chain : CHAIN_HIST - 1]++;
+  }
+
+#pragma omp critical(table_stats)
+  {
+    table_stats = realloc(table_stats,
+                          (num_table_stats + 1) * sizeof(TableStats));
+    if (!table_stats) {
+      fprintf(stderr, "Memory allocation error\n");
+      exit(1);
+    }
+    table_stats[num_table_stats++] = st;
+  }
+}
+
+void print_table_stats(void) {
+  printf("\nHash table stats:\n");
+  printf("  %-12s %8s %9s %7s %9s %10s %13s\n", "Map", "Buckets", "Items",
+         "Load", "Max chain", "Mean chain", "Probes/lookup");
+  for (int m = 0; m < num_table_stats; m++) {
+    TableStats *st = &table_stats[m];
+    printf("  %-12s %8d %9d %7.3f %9d %10.3f %13.3f\n", st->label,
+           st->buckets, st->items, (double)st->items / st->buckets,
+           st->max_chain, st->used ? (double)st->items / st->used : 0,
+           st->lookups ? (double)st->probes / st->lookups : 0);
+  }
+
+  printf("\nBuckets by chain length:\n  %-12s", "Map");
+  for (int c = 0; c < CHAIN_HIST; c++)
+    printf(" %7d%s", c, c == CHAIN_HIST - 1 ? "+" : " ");
+  printf("\n");
+  for (int m = 0; m < num_table_stats; m++) {
+    printf("  %-12s", table_stats[m].label);
+    for (int c = 0; c < CHAIN_HIST; c++)
+      printf(" %7d ", table_stats[m].hist[c]);
+    printf("\n");
+  }
+}
+
+void clear_hashmap(HashMap *map) {
   for (int i = 0; i < map->size; i++) {
     WordNode *current = map->buckets[i];
     while (current) {
@@ -119,9 +662,17 @@ void free_hashmap(HashMap *map) {
       free(temp->word);
       free(temp);
     }
+    map->buckets[i] = NULL;
   }
+  count_allocs(0, 2 * map->items);
+  map->items = 0;
+}
+
+void free_hashmap(HashMap *map) {
+  clear_hashmap(map);
   free(map->buckets);
   free(map);
+  count_allocs(0, 2);
 }
 
 int is_delimiter(char c, const char *delimiters) {
@@ -133,89 +684,211 @@ int is_delimiter(char c, const char *delimiters) {
   return 0;
 }
 
-HashMap *process_file_sync(const char *filename, const char *delimiters) {
-  FILE *file = fopen(filename, "r");
-  if (!file) {
-    fprintf(stderr, "Error opening file %s\n", filename);
-    return NULL;
-  }
+int is_word_break(char c, const char *delimiters) {
+  return c == '\n' || c == '\r' || is_delimiter(c, delimiters);
+}
 
-  HashMap *word_map = create_hashmap(HASH_TABLE_SIZE);
+// Counts the words that start in [begin, end) of buf. A word cut by begin
+// belongs to whoever counts the bytes before it; a word cut by end is
+// finished from the bytes that follow, up to len.
+void count_span(HashMap *map, const char *buf, size_t len, size_t begin,
+                size_t end, const char *delimiters) {
   char word[MAX_WORD_LEN];
-  int word_len = 0;
-  int c;
+  size_t i = begin;
+  unsigned long long tokens = 0;
+  int items = map->items;
+  Stamp start = stamp_now();
+  Stamp inserting = {0};
 
-  while ((c = fgetc(file)) != EOF) {
-    if (is_delimiter(c, delimiters) || c == '\n' || c == '\r') {
-      if (word_len > 0) {
-        word[word_len] = '\0';
-        insert_word(word_map, word);
-        word_len = 0;
-      }
-    } else if (word_len < MAX_WORD_LEN - 1) {
-      word[word_len++] = c;
+  if (i > 0 && !is_word_break(buf[i - 1], delimiters))
+    while (i < end && !is_word_break(buf[i], delimiters))
+      i++;
+
+  while (i < end) {
+    if (is_word_break(buf[i], delimiters)) {
+      i++;
+      continue;
+    }
+    int word_len = 0;
+    for (; i < len && !is_word_break(buf[i], delimiters); i++)
+      if (word_len < MAX_WORD_LEN - 1)
+        word[word_len++] = buf[i];
+    word[word_len] = '\0';
+    tokens++;
+    if (phase_timing) {
+      Stamp before = clock_now();
+      insert_word(map, word);
+      Stamp after = clock_now();
+      inserting.seconds += after.seconds - before.seconds;
+      inserting.cycles += after.cycles - before.cycles;
+    } else {
+      insert_word(map, word);
     }
   }
 
-  if (word_len > 0) {
-    word[word_len] = '\0';
-    insert_word(word_map, word);
+  // Without --phases inserting stays zero and all of it counts as tokenizing.
+  // Hardware counters are only read per span and always count as tokenizing.
+  ThreadStats *ts = &thread_stats[omp_get_thread_num()];
+  phase_add(PHASE_TOKENIZE, start);
+  ts->phase[PHASE_TOKENIZE] -= inserting.seconds;
+  ts->cycles[PHASE_TOKENIZE] -= inserting.cycles;
+  ts->phase[PHASE_INSERT] += inserting.seconds;
+  ts->cycles[PHASE_INSERT] += inserting.cycles;
+  ts->bytes += end > begin ? end - begin : 0;
+  ts->tokens += tokens;
+  ts->new_words += map->items - items;
+}
+
+// Buffers are aligned so that files opened with O_DIRECT can read into them.
+char *alloc_block_buffer(size_t size) {
+  void *buf;
+  if (posix_memalign(&buf, IO_ALIGN, size) != 0) {
+    fprintf(stderr, "Memory allocation error\n");
+    exit(1);
   }
+  return buf;
+}
 
-  fclose(file);
-  LOG("Processed file %s, items: %d", filename, word_map->items);
-  return word_map;
+// Opens an input, "-" being stdin. With --direct-io, files are opened with
+// O_DIRECT where the filesystem supports it.
+int open_input(const char *filename) {
+  if (strcmp(filename, "-") == 0)
+    return STDIN_FILENO;
+#ifdef O_DIRECT
+  if (direct_io) {
+    int fd = open(filename, O_RDONLY | O_DIRECT);
+    if (fd >= 0 || errno != EINVAL)
+      return fd;
+  }
+#endif
+  return open(filename, O_RDONLY);
 }
 
-HashMap *process_files_parallel(char **filenames, int num_files,
-                                const char *delimiters, int num_threads) {
-  HashMap *global_map = create_hashmap(HASH_TABLE_SIZE);
+int is_direct(int fd) {
+#ifdef O_DIRECT
+  return (fcntl(fd, F_GETFL) & O_DIRECT) != 0;
+#else
+  return 0;
+#endif
+}
 
-  LOG("Starting parallel processing with %d threads...\n", num_threads);
-  omp_set_num_threads(num_threads);
+// With --direct-io on a file that could not be opened with O_DIRECT, drops
+// the bytes just read from the page cache instead.
+void drop_cached(int fd, off_t offset, off_t len) {
+  if (direct_io && !is_direct(fd))
+    posix_fadvise(fd, offset, len, POSIX_FADV_DONTNEED);
+}
 
-#pragma omp parallel shared(global_map, filenames, num_files, delimiters)
-  {
-    int thread_id = omp_get_thread_num();
-    HashMap *local_map = create_hashmap(HASH_TABLE_SIZE);
+// Reads the next chunk of input into buf, which holds BLOCK_HEADROOM bytes
+// followed by cap bytes. A chunk starts with the word cut off by the previous
+// read and ends on a word break, so chunks can be counted independently.
+// Returns the chunk and sets *len, or returns NULL at the end of input.
+char *read_block(BlockReader *r, char *buf, size_t cap, const char *delimiters,
+                 size_t *len) {
+  char *data = buf + BLOCK_HEADROOM;
 
-    if (!local_map) {
-      fprintf(stderr, "Error allocating hash table for thread %d\n", thread_id);
-      exit(1);
+  while (!r->eof) {
+    size_t n = 0;
+    while (n < cap) {
+      ssize_t got = read(r->fd, data + n, cap - n);
+      if (got < 0 && errno == EINTR)
+        continue;
+      if (got < 0)
+        perror("Error reading input");
+      if (got <= 0) {
+        r->eof = 1;
+        break;
+      }
+      n += got;
+      if (r->partial)
+        break;
+      // A short read is the end of the file, and the next O_DIRECT read
+      // would start at an unaligned offset.
+      if (r->direct && n < cap) {
+        r->eof = 1;
+        break;
+      }
     }
+    drop_cached(r->fd, r->bytes, n);
+    r->bytes += n;
 
-    LOG("Thread %d started\n", thread_id);
-#pragma omp for schedule(dynamic)
-    for (int i = 0; i < num_files; i++) {
-      LOG("Thread %d processing file %s\n", thread_id, filenames[i]);
-      HashMap *file_map = process_file_sync(filenames[i], delimiters);
-      if (file_map) {
-        merge_hashmaps(local_map, file_map);
-        free_hashmap(file_map);
-      }
+    char *start = data - r->tail_len;
+    memcpy(start, r->tail, r->tail_len);
+    size_t total = r->tail_len + n;
+    if (r->eof && !r->follow) {
+      r->tail_len = 0;
+      *len = total;
+      return total ? start : NULL;
     }
-    LOG("Thread %d finished processing\n", thread_id);
-    LOG("Thread %d merging results...\n", thread_id);
-    merge_hashmaps(global_map, local_map);
-    LOG("Thread %d merge complete\n", thread_id);
 
-    free_hashmap(local_map);
+    size_t cut = total;
+    while (cut > 0 && !is_word_break(start[cut - 1], delimiters))
+      cut--;
+    // Only the first MAX_WORD_LEN - 1 bytes of a word are ever counted.
+    size_t tail = total - cut;
+    r->tail_len = tail < MAX_WORD_LEN - 1 ? tail : MAX_WORD_LEN - 1;
+    memcpy(r->tail, start + cut, r->tail_len);
+    if (cut > 0) {
+      *len = cut;
+      return start;
+    }
   }
-
-  return global_map;
+  return NULL;
 }
 
-HashMap *process_files_sync(char **filenames, int num_files,
-                            const char *delimiters) {
-  HashMap *global_map = create_hashmap(HASH_TABLE_SIZE);
+// Returns the order in which to hand out files: largest first, so that a big
+// file listed last does not finish alone (LPT scheduling). With --keep-order
+// files are handed out as given. Files that cannot be stat'ed count as empty.
+int *schedule_order(char **filenames, int num_files) {
+  int *order = malloc(num_files * sizeof(int));
+  off_t *sizes = malloc(num_files * sizeof(off_t));
   for (int i = 0; i < num_files; i++) {
-    HashMap *file_map = process_file_sync(filenames[i], delimiters);
-    if (file_map) {
-      merge_hashmaps(global_map, file_map);
-      free_hashmap(file_map);
-    }
+    struct stat st;
+    order[i] = i;
+    sizes[i] = stat(filenames[i], &st) == 0 ? st.st_size : 0;
   }
-  return global_map;
+
+  // Insertion sort, stable so equal sizes keep their given order.
+  for (int i = 1; i < num_files && !keep_order; i++) {
+    int file = order[i];
+    int j = i;
+    for (; j > 0 && sizes[order[j - 1]] < sizes[file]; j--)
+      order[j] = order[j - 1];
+    order[j] = file;
+  }
+
+  free(sizes);
+  return order;
+}
+
+HashMap *process_file_sync(const char *filename, const char *delimiters,
+                           int doc) {
+  int fd = open_input(filename);
+  if (fd < 0) {
+    fprintf(stderr, "Error opening file %s\n", filename);
+    return NULL;
+  }
+
+  HashMap *word_map = create_hashmap(HASH_TABLE_SIZE);
+  word_map->doc = doc;
+  BlockReader reader = {.fd = fd, .direct = is_direct(fd)};
+  char *buf = alloc_block_buffer(BLOCK_HEADROOM + READ_SIZE);
+
+  for (;;) {
+    size_t len;
+    Stamp start = stamp_now();
+    char *chunk = read_block(&reader, buf, READ_SIZE, delimiters, &len);
+    phase_add(PHASE_READ, start);
+    if (!chunk)
+      break;
+    count_span(word_map, chunk, len, 0, len, delimiters);
+  }
+
+  free(buf);
+  if (fd != STDIN_FILENO)
+    close(fd);
+  LOG("Processed file %s, items: %d", filename, word_map->items);
+  return word_map;
 }
 
 int compare_words(const void *a, const void *b) {
@@ -228,104 +901,2173 @@ int compare_words(const void *a, const void *b) {
   return strcmp(wa->word, wb->word);
 }
 
-void print_results(HashMap *map, int top_n) {
-  WordFreq *words = malloc(map->items * sizeof(WordFreq));
-  int idx = 0;
+void sift_down(WordFreq *heap, int n, int i) {
+  for (;;) {
+    int worst = i;
+    int l = 2 * i + 1, r = 2 * i + 2;
+    if (l < n && compare_words(&heap[l], &heap[worst]) > 0)
+      worst = l;
+    if (r < n && compare_words(&heap[r], &heap[worst]) > 0)
+      worst = r;
+    if (worst == i)
+      return;
+    WordFreq tmp = heap[i];
+    heap[i] = heap[worst];
+    heap[worst] = tmp;
+    i = worst;
+  }
+}
+
+// Keeps the top_n best words in a heap rooted at the worst of them, so the
+// whole map is never sorted. Returns the number of words written to out.
+int select_top_n(HashMap *map, int top_n, WordFreq *out) {
+  int n = 0;
+  Stamp start = stamp_now();
 
   for (int i = 0; i < map->size; i++) {
-    WordNode *current = map->buckets[i];
-    while (current) {
-      words[idx].word = current->word;
-      words[idx].count = current->count;
-      idx++;
-      current = current->next;
+    for (WordNode *current = map->buckets[i]; current;
+         current = current->next) {
+      WordFreq wf = {current->word, current->count, current->df};
+      if (n < top_n) {
+        out[n++] = wf;
+        if (n == top_n)
+          for (int j = n / 2 - 1; j >= 0; j--)
+            sift_down(out, n, j);
+      } else if (top_n > 0 && compare_words(&wf, &out[0]) < 0) {
+        out[0] = wf;
+        sift_down(out, n, 0);
+      }
     }
   }
 
-  qsort(words, map->items, sizeof(WordFreq), compare_words);
+  qsort(out, n, sizeof(WordFreq), compare_words);
+  phase_add(PHASE_SORT, start);
+  return n;
+}
 
-  printf("\nTop %d words by frequency:\n", top_n);
-  printf("----------------------------\n");
-  printf("| %-16s | %-7s |\n", "Word", "Count");
-  printf("----------------------------\n");
+void fill_report(FileReport *report, HashMap *file_map, int top_n) {
+  report->top = malloc(top_n * sizeof(WordFreq));
+  report->count = select_top_n(file_map, top_n, report->top);
+  report->items = file_map->items;
+  for (int j = 0; j < report->count; j++)
+    report->top[j].word = strdup(report->top[j].word);
+}
 
-  for (int i = 0; i < map->items && i < top_n; i++) {
-    printf("| %-16s | %-7d |\n", words[i].word, words[i].count);
+void init_queue(BlockQueue *q, size_t min_capacity) {
+  size_t capacity = 1;
+  while (capacity < min_capacity)
+    capacity <<= 1;
+  q->cells = malloc(capacity * sizeof(QueueCell));
+  if (!q->cells) {
+    fprintf(stderr, "Memory allocation error\n");
+    exit(1);
   }
-  printf("----------------------------\n");
+  for (size_t i = 0; i < capacity; i++)
+    atomic_init(&q->cells[i].seq, i);
+  q->mask = capacity - 1;
+  atomic_init(&q->head, 0);
+  atomic_init(&q->tail, 0);
+}
 
-  free(words);
+// Returns 0 if the queue is full.
+int queue_push(BlockQueue *q, Block *block) {
+  size_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+  for (;;) {
+    QueueCell *cell = &q->cells[pos & q->mask];
+    size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+    intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&q->head, &pos, pos + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        cell->block = block;
+        atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+        return 1;
+      }
+    } else if (diff < 0) {
+      return 0;
+    } else {
+      pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+    }
+  }
 }
 
-void run_benchmark(char **filenames, int num_files, const char *delimiters) {
-  printf("\nBenchmark results:\n");
-  printf("--------------------------------------------------\n");
-  printf("| %-12s | %-15s | %-15s |\n", "Method", "Time (s)", "Speedup");
-  printf("--------------------------------------------------\n");
+// Returns NULL if the queue is empty.
+Block *queue_pop(BlockQueue *q) {
+  size_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  for (;;) {
+    QueueCell *cell = &q->cells[pos & q->mask];
+    size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+    intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&q->tail, &pos, pos + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        Block *block = cell->block;
+        atomic_store_explicit(&cell->seq, pos + q->mask + 1,
+                              memory_order_release);
+        return block;
+      }
+    } else if (diff < 0) {
+      return NULL;
+    } else {
+      pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    }
+  }
+}
 
-  double sync_time;
-  {
-    LOG("Running sync version...\n");
-    double start = omp_get_wtime();
-    HashMap *sync_map = process_files_sync(filenames, num_files, delimiters);
-    double end = omp_get_wtime();
+Block *get_free_block(Pipeline *p) {
+  Block *block = queue_pop(&p->free_blocks);
+  if (block)
+    return block;
+  double start = omp_get_wtime();
+  while (!(block = queue_pop(&p->free_blocks)))
+    sched_yield();
+  trace_add(TRACE_WAIT, start, omp_get_wtime(), -1);
+  return block;
+}
 
-    sync_time = end - start;
-    printf("| %-12s | %-15.6f | %-15.6f |\n", "Sync", sync_time, 1.0);
-    LOG("Unique words in sync: %d\n", sync_map->items);
-    free_hashmap(sync_map);
+// Reads whole files one after another in word-aligned blocks.
+void read_files_sequential(Pipeline *p) {
+  int k;
+  while ((k = atomic_fetch_add(&p->next_file, 1)) < p->num_files) {
+    int i = p->order[k];
+    LOG("Reader %d reading file %s\n", omp_get_thread_num(), p->filenames[i]);
+    int fd = open_input(p->filenames[i]);
+    if (fd < 0) {
+      fprintf(stderr, "Error opening file %s\n", p->filenames[i]);
+      continue;
+    }
+    BlockReader reader = {.fd = fd, .direct = is_direct(fd)};
+    for (;;) {
+      Block *block = get_free_block(p);
+      Stamp start = stamp_now();
+      block->data = read_block(&reader, block->buf, READ_SIZE, p->delimiters,
+                               &block->len);
+      thread_stats[omp_get_thread_num()].busy += phase_add(PHASE_READ, start);
+      if (!block->data) {
+        queue_push(&p->free_blocks, block);
+        break;
+      }
+      block->begin = 0;
+      block->end = block->len;
+      queue_push(&p->full_blocks, block);
+    }
+    if (fd != STDIN_FILENO)
+      close(fd);
   }
+}
 
-  int thread_counts[] = {2, 4, 8};
+// A read covers the task's bytes, plus the bytes before them to tell whether
+// the first word starts there and the bytes after them to finish the last
+// word. Blocks can therefore be read and counted in any order. Both margins
+// are IO_ALIGN bytes to keep O_DIRECT reads aligned.
+off_t task_read_offset(ReadTask *task) {
+  return task->offset > 0 ? task->offset - IO_ALIGN : 0;
+}
 
-  for (int i = 0; i < sizeof(thread_counts) / sizeof(thread_counts[0]); i++) {
-    int threads = thread_counts[i];
+size_t task_read_len(ReadTask *task) {
+  size_t len = (task->len + IO_ALIGN - 1) / IO_ALIGN * IO_ALIGN;
+  return (task->offset > 0 ? IO_ALIGN : 0) + len + IO_ALIGN;
+}
 
-    LOG("Running parallel version with %d threads...\n", threads);
-    double start = omp_get_wtime();
-    HashMap *parallel_map =
-        process_files_parallel(filenames, num_files, delimiters, threads);
-    double end = omp_get_wtime();
+void set_task_block(Block *block, ReadTask *task, ssize_t got) {
+  size_t lead = task->offset > 0 ? IO_ALIGN : 0;
+  block->data = block->buf;
+  block->len = got > 0 ? got : 0;
+  block->begin = lead;
+  block->end = lead + task->len < block->len ? lead + task->len : block->len;
+}
 
-    double parallel_time = end - start;
-    double speedup = sync_time / parallel_time;
+// Pushes the block once got bytes of the task's read are in its buffer.
+void finish_task_block(Pipeline *p, Block *block, ReadTask *task,
+                       ssize_t got) {
+  if (got > 0)
+    drop_cached(p->fds[task->file], task_read_offset(task), got);
+  set_task_block(block, task, got);
+  if (block->end > block->begin)
+    queue_push(&p->full_blocks, block);
+  else
+    queue_push(&p->free_blocks, block);
+}
 
-    printf("| %-5s (%d) | %-15.6f | %-15.6f |\n", "Parallel", threads,
-           parallel_time, speedup);
-    free_hashmap(parallel_map);
+// Reads len bytes at offset, or up to the end of the file, resuming after a
+// short read. O_DIRECT reads resume at the last IO_ALIGN boundary, so the
+// unaligned tail of a short read is read again.
+ssize_t pread_full(int fd, char *buf, size_t len, off_t offset) {
+  size_t align = is_direct(fd) ? IO_ALIGN : 1;
+  size_t done = 0;
+  while (done < len) {
+    size_t from = done / align * align;
+    ssize_t got = pread(fd, buf + from, len - from, offset + from);
+    if (got < 0 && errno == EINTR)
+      continue;
+    if (got < 0) {
+      perror("Error reading input");
+      return -1;
+    }
+    if (from + got <= done)
+      break;
+    done = from + got;
   }
+  return done;
+}
 
-  printf("--------------------------------------------------\n");
+// Portable reader: every reader thread takes the next fixed-size read.
+void read_tasks_pread(Pipeline *p) {
+  int t;
+  while ((t = atomic_fetch_add(&p->next_task, 1)) < p->num_tasks) {
+    ReadTask *task = &p->tasks[t];
+    Block *block = get_free_block(p);
+    Stamp start = stamp_now();
+    ssize_t got = pread_full(p->fds[task->file], block->buf,
+                             task_read_len(task), task_read_offset(task));
+    thread_stats[omp_get_thread_num()].busy += phase_add(PHASE_READ, start);
+    finish_task_block(p, block, task, got);
+  }
 }
 
-void print_usage() {
-  printf("Usage: program [options] file1 [file2 ...]\n");
-  printf("Options:\n");
-  printf("  -n <num>          Number of threads (default: 4)\n");
-  printf("  -d <delimiters>   Delimiters (default: \" ,.!?;:\")\n");
-  printf("  -t <num>          Top N words to print (default: 10)\n");
-  printf("  -b                Run benchmark mode\n");
-  printf("  -r                Show top N words\n");
-  printf("  -v                Disable verbose output\n");
-  printf("  -h                Show help\n");
+#ifdef HAVE_IO_URING
+typedef struct {
+  int fd;
+  unsigned *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ring, *cq_ring;
+  size_t sq_ring_size, cq_ring_size, sqes_size;
+} Uring;
+
+int uring_setup(Uring *u, unsigned entries) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  u->fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (u->fd < 0)
+    return -1;
+
+  int single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+  u->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  u->cq_ring_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (single_mmap && u->cq_ring_size > u->sq_ring_size)
+    u->sq_ring_size = u->cq_ring_size;
+  u->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+  u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+  u->cq_ring = single_mmap ? u->sq_ring
+                           : mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE,
+                                  MAP_SHARED | MAP_POPULATE, u->fd,
+                                  IORING_OFF_CQ_RING);
+  u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+  if (u->sq_ring == MAP_FAILED || u->cq_ring == MAP_FAILED ||
+      u->sqes == MAP_FAILED) {
+    close(u->fd);
+    return -1;
+  }
+  if (single_mmap)
+    u->cq_ring_size = 0;
+
+  char *sq = u->sq_ring, *cq = u->cq_ring;
+  u->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  u->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+  u->sq_array = (unsigned *)(sq + params.sq_off.array);
+  u->cq_head = (unsigned *)(cq + params.cq_off.head);
+  u->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  u->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+  return 0;
 }
 
-int main(int argc, char **argv) {
-  char *delimiters = " ,.!?;:";
-  int top_n = 10;
-  int run_bench = 0;
-  int print_list = 0;
-  int num_threads = 4;
+void uring_free(Uring *u) {
+  munmap(u->sqes, u->sqes_size);
+  if (u->cq_ring_size)
+    munmap(u->cq_ring, u->cq_ring_size);
+  munmap(u->sq_ring, u->sq_ring_size);
+  close(u->fd);
+}
 
-  int i;
-  for (i = 1; i < argc; i++) {
-    if (argv[i][0] != '-')
-      break;
+// Only the submitting thread touches the submission tail and completion head.
+void uring_prep_read(Uring *u, int fd, char *buf, size_t len, off_t offset,
+                     int buf_index, unsigned long long user_data) {
+  unsigned tail = *u->sq_tail;
+  unsigned idx = tail & *u->sq_mask;
+  struct io_uring_sqe *sqe = &u->sqes[idx];
 
-    switch (argv[i][1]) {
-    case 'd':
-      if (i + 1 < argc)
-        delimiters = argv[++i];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = buf_index >= 0 ? IORING_OP_READ_FIXED : IORING_OP_READ;
+  sqe->fd = fd;
+  sqe->addr = (unsigned long)buf;
+  sqe->len = len;
+  sqe->off = offset;
+  sqe->buf_index = buf_index >= 0 ? buf_index : 0;
+  sqe->user_data = user_data;
+  u->sq_array[idx] = idx;
+  __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// Keeps up to every free buffer in flight as fixed-size reads across all
+// files, handing each completed block to the tokenizers. Returns -1 if the
+// kernel has no io_uring, leaving all tasks to read_tasks_pread().
+int read_tasks_uring(Pipeline *p) {
+  Uring ring;
+  unsigned entries = 1;
+  while (entries < (unsigned)p->pool_size)
+    entries <<= 1;
+  if (uring_setup(&ring, entries) < 0)
+    return -1;
+
+  // Registered buffers skip the per-read page pinning; fall back to plain
+  // reads when the memlock limit does not allow registering them.
+  struct iovec *iov = malloc(p->pool_size * sizeof(struct iovec));
+  for (int b = 0; b < p->pool_size; b++) {
+    iov[b].iov_base = p->pool[b].buf;
+    iov[b].iov_len = BLOCK_BUF_SIZE;
+  }
+  int fixed = syscall(__NR_io_uring_register, ring.fd,
+                      IORING_REGISTER_BUFFERS, iov, p->pool_size) == 0;
+  free(iov);
+  LOG("io_uring reader with %u entries, %s buffers\n", entries,
+      fixed ? "registered" : "unregistered");
+
+  ReadTask **in_flight = calloc(p->pool_size, sizeof(ReadTask *));
+  int pending = 0;
+  int more = 1;
+  while (more || pending > 0) {
+    int to_submit = 0;
+    Block *block;
+    while (more && (block = queue_pop(&p->free_blocks))) {
+      int t = atomic_fetch_add(&p->next_task, 1);
+      if (t >= p->num_tasks) {
+        queue_push(&p->free_blocks, block);
+        more = 0;
+        break;
+      }
+      ReadTask *task = &p->tasks[t];
+      int b = block - p->pool;
+      in_flight[b] = task;
+      uring_prep_read(&ring, p->fds[task->file], block->buf,
+                      task_read_len(task), task_read_offset(task),
+                      fixed ? b : -1, b);
+      to_submit++;
+    }
+    if (!to_submit && !pending) {
+      sched_yield();
+      continue;
+    }
+    pending += to_submit;
+    Stamp start = stamp_now();
+    if (syscall(__NR_io_uring_enter, ring.fd, to_submit, 1,
+                IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+        errno != EINTR) {
+      perror("io_uring_enter");
+      exit(1);
+    }
+    thread_stats[omp_get_thread_num()].busy += phase_add(PHASE_READ, start);
+
+    unsigned head = *ring.cq_head;
+    while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+      Block *done = &p->pool[cqe->user_data];
+      ReadTask *task = in_flight[cqe->user_data];
+      ssize_t got = cqe->res;
+      if (got < 0) {
+        fprintf(stderr, "Error reading %s: %s\n", p->filenames[task->file],
+                strerror(-got));
+      } else if (got > 0 && (size_t)got < task_read_len(task)) {
+        // Short read: the rest is read from the last aligned offset.
+        size_t from = got / IO_ALIGN * IO_ALIGN;
+        ssize_t rest = pread_full(p->fds[task->file], done->buf + from,
+                                  task_read_len(task) - from,
+                                  task_read_offset(task) + from);
+        if (rest >= 0)
+          got = from + rest;
+      }
+      finish_task_block(p, done, task, got);
+      pending--;
+      head++;
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+  }
+
+  free(in_flight);
+  uring_free(&ring);
+  return 0;
+}
+#endif
+
+// Closes the first n descriptors of plan_read_tasks() and frees them.
+void close_planned(Pipeline *p, int n) {
+  for (int j = 0; j < n; j++)
+    if (p->fds[j] >= 0 && p->fds[j] != STDIN_FILENO)
+      close(p->fds[j]);
+  free(p->fds);
+  p->fds = NULL;
+}
+
+// Splits every file into fixed-size read tasks. Returns -1 if an input is
+// not a regular file that can be read at an offset, such as stdin or a FIFO.
+// Such inputs are checked by name before they are opened, since opening and
+// closing a FIFO's only reader can lose what the writer sends.
+int plan_read_tasks(Pipeline *p) {
+  p->fds = malloc(p->num_files * sizeof(int));
+  off_t *sizes = malloc(p->num_files * sizeof(off_t));
+  p->num_tasks = 0;
+  for (int i = 0; i < p->num_files; i++) {
+    struct stat st;
+    if (strcmp(p->filenames[i], "-") == 0 ||
+        (stat(p->filenames[i], &st) == 0 && !S_ISREG(st.st_mode))) {
+      close_planned(p, i);
+      free(sizes);
+      return -1;
+    }
+    p->fds[i] = open_input(p->filenames[i]);
+    if (p->fds[i] < 0) {
+      fprintf(stderr, "Error opening file %s\n", p->filenames[i]);
+      sizes[i] = 0;
+    } else if (fstat(p->fds[i], &st) == 0 && S_ISREG(st.st_mode)) {
+      sizes[i] = st.st_size;
+    } else {
+      close_planned(p, i + 1);
+      free(sizes);
+      return -1;
+    }
+    p->num_tasks += (sizes[i] + READ_SIZE - 1) / READ_SIZE;
+  }
+
+  p->tasks = malloc(p->num_tasks * sizeof(ReadTask));
+  int t = 0;
+  for (int i = 0; i < p->num_files; i++) {
+    for (off_t offset = 0; offset < sizes[i]; offset += READ_SIZE) {
+      p->tasks[t].file = i;
+      p->tasks[t].offset = offset;
+      p->tasks[t].len = READ_SIZE;
+      t++;
+    }
+  }
+  free(sizes);
+  return 0;
+}
+
+// Three-stage engine: reader threads fill recycled buffers with blocks and
+// hand them to the tokenizer threads through a lock-free queue, so disk reads
+// overlap counting. Each tokenizer counts into its own map. Readers either
+// read whole files sequentially, or issue fixed-size reads with pread() or
+// through io_uring, which keeps many reads in flight from a single thread.
+HashMap *process_files_pipeline(char **filenames, int num_files,
+                                const char *delimiters, int num_threads,
+                                int readers) {
+  Pipeline p = {.filenames = filenames,
+                .order = schedule_order(filenames, num_files),
+                .num_files = num_files,
+                .delimiters = delimiters};
+  int backend = io_backend;
+  if (backend != IO_READ && plan_read_tasks(&p) < 0) {
+    LOG("Offset reads need regular files, reading sequentially\n");
+    backend = IO_READ;
+  }
+  if (backend == IO_URING)
+    readers = 1;
+
+  p.pool_size = BLOCKS_PER_THREAD * (num_threads + readers);
+  if (backend == IO_URING)
+    p.pool_size += URING_DEPTH;
+  p.pool = calloc(p.pool_size, sizeof(Block));
+  init_queue(&p.free_blocks, p.pool_size);
+  init_queue(&p.full_blocks, p.pool_size);
+  for (int b = 0; b < p.pool_size; b++) {
+    p.pool[b].buf = alloc_block_buffer(BLOCK_BUF_SIZE);
+    queue_push(&p.free_blocks, &p.pool[b]);
+  }
+  atomic_init(&p.next_file, 0);
+  atomic_init(&p.next_task, 0);
+  atomic_init(&p.readers_active, readers);
+  stats_threads = readers + num_threads;
+
+  HashMap *global_map = create_hashmap(HASH_TABLE_SIZE);
+
+  LOG("Starting pipeline with %d readers and %d tokenizers...\n", readers,
+      num_threads);
+
+#pragma omp parallel num_threads(readers + num_threads)
+  {
+    // The runtime may give a smaller team, e.g. with OMP_THREAD_LIMIT or
+    // OMP_DYNAMIC. Readers and tokenizers then share out the threads there are.
+#pragma omp single
+    {
+      int team = omp_get_num_threads();
+      if (team < 2) {
+        fprintf(stderr, "Error: The pipeline needs at least 2 threads, "
+                        "the runtime gave %d\n", team);
+        exit(1);
+      }
+      if (team < readers + num_threads) {
+        int shared = readers * team / (readers + num_threads);
+        readers = shared > 0 ? shared : 1;
+        LOG("Got %d threads, running %d readers and %d tokenizers\n", team,
+            readers, team - readers);
+        atomic_store(&p.readers_active, readers);
+        stats_threads = team;
+      }
+    }
+    int thread_id = omp_get_thread_num();
+
+    if (thread_id < readers) {
+      if (backend == IO_READ) {
+        read_files_sequential(&p);
+      } else {
+#ifdef HAVE_IO_URING
+        if (backend == IO_URING && read_tasks_uring(&p) < 0)
+          LOG("io_uring is not available, using pread\n");
+#endif
+        // Picks up every task io_uring did not claim.
+        read_tasks_pread(&p);
+      }
+      atomic_fetch_sub(&p.readers_active, 1);
+    } else {
+      HashMap *local_map = create_hashmap(HASH_TABLE_SIZE);
+      double waiting = 0; // since when the queue has been empty
+      for (;;) {
+        Block *block = queue_pop(&p.full_blocks);
+        // Blocks pushed before the last reader finished are visible now.
+        if (!block && atomic_load(&p.readers_active) == 0 &&
+            !(block = queue_pop(&p.full_blocks)))
+          break;
+        if (!block) {
+          if (!waiting)
+            waiting = omp_get_wtime();
+          sched_yield();
+          continue;
+        }
+        double start = omp_get_wtime();
+        if (waiting) {
+          trace_add(TRACE_WAIT, waiting, start, -1);
+          waiting = 0;
+        }
+        count_span(local_map, block->data, block->len, block->begin,
+                   block->end, delimiters);
+        thread_stats[thread_id].busy += omp_get_wtime() - start;
+        queue_push(&p.free_blocks, block);
+      }
+      LOG("Tokenizer %d merging results...\n", thread_id);
+      Stamp start = stamp_now();
+      merge_hashmaps(global_map, local_map);
+      phase_add(PHASE_GLOBAL_MERGE, start);
+      if (show_table_stats)
+        record_table_stats(local_map, "thread %d", thread_id);
+      free_hashmap(local_map);
+    }
+  }
+
+  if (p.tasks) {
+    for (int i = 0; i < num_files; i++)
+      if (p.fds[i] >= 0 && p.fds[i] != STDIN_FILENO)
+        close(p.fds[i]);
+    free(p.fds);
+    free(p.tasks);
+  }
+  for (int b = 0; b < p.pool_size; b++)
+    free(p.pool[b].buf);
+  free(p.pool);
+  free(p.order);
+  free(p.free_blocks.cells);
+  free(p.full_blocks.cells);
+  return global_map;
+}
+
+// Takes the next chunk of the owner's current file, starting its next file
+// when the current one is done. Returns 0 if the deque has no work left.
+int take_work(WorkDeque *d, off_t *sizes, ReadTask *task) {
+  int found = 0;
+  omp_set_lock(&d->lock);
+  while (d->file < 0 || d->next >= d->end) {
+    if (d->head == d->tail) {
+      d->file = -1;
+      break;
+    }
+    d->file = d->files[d->head++];
+    d->next = 0;
+    d->end = sizes[d->file];
+  }
+  if (d->file >= 0) {
+    task->file = d->file;
+    task->offset = d->next;
+    task->len = d->end - d->next < READ_SIZE ? d->end - d->next : READ_SIZE;
+    d->next += task->len;
+    found = 1;
+  }
+  omp_unset_lock(&d->lock);
+  return found;
+}
+
+// Moves work from another thread to the empty deque of thread me: a file it
+// has not started, or else the back half of the file it is reading. A split
+// lands on an IO_ALIGN boundary, and count_span() realigns it on a word
+// break when the chunks on either side are counted.
+int steal_work(WorkDeque *deques, int num_threads, int me) {
+  double start = omp_get_wtime();
+  for (int k = 1; k < num_threads; k++) {
+    WorkDeque *victim = &deques[(me + k) % num_threads];
+    int file = -1;
+    off_t next = 0, end = 0;
+
+    omp_set_lock(&victim->lock);
+    if (victim->head < victim->tail) {
+      file = victim->files[--victim->tail];
+      end = -1;
+    } else if (victim->file >= 0 &&
+               victim->end - victim->next >= 2 * READ_SIZE) {
+      off_t half = (victim->end - victim->next) / 2 / IO_ALIGN * IO_ALIGN;
+      file = victim->file;
+      next = victim->next + half;
+      end = victim->end;
+      victim->end = next;
+    }
+    omp_unset_lock(&victim->lock);
+
+    if (file < 0)
+      continue;
+    LOG("Thread %d stole %s of file %d from thread %d\n", me,
+        end < 0 ? "all" : "half", file, (me + k) % num_threads);
+    WorkDeque *d = &deques[me];
+    omp_set_lock(&d->lock);
+    if (end < 0) {
+      d->files[d->tail++] = file;
+    } else {
+      d->file = file;
+      d->next = next;
+      d->end = end;
+    }
+    omp_unset_lock(&d->lock);
+    trace_add(TRACE_STEAL, start, omp_get_wtime(), file);
+    return 1;
+  }
+  return 0;
+}
+
+// Each thread starts with a share of the files and reads them in READ_SIZE
+// chunks; a thread that runs dry steals from the others, so one large file
+// listed last is still read by all threads. Pipes and other inputs that
+// cannot be read at an offset are each read whole by one thread.
+HashMap *process_files_stealing(char **filenames, int num_files,
+                                const char *delimiters, int num_threads) {
+  off_t *sizes = malloc(num_files * sizeof(off_t));
+  int *fds = malloc(num_files * sizeof(int));
+  int *streams = malloc(num_files * sizeof(int));
+  int num_streams = 0;
+  atomic_int next_stream;
+  atomic_init(&next_stream, 0);
+  WorkDeque *deques = calloc(num_threads, sizeof(WorkDeque));
+  for (int t = 0; t < num_threads; t++) {
+    omp_init_lock(&deques[t].lock);
+    deques[t].files = malloc(num_files * sizeof(int));
+    deques[t].file = -1;
+  }
+  int *order = schedule_order(filenames, num_files);
+  int dealt = 0;
+  for (int k = 0; k < num_files; k++) {
+    int i = order[k];
+    struct stat st;
+    fds[i] = open_input(filenames[i]);
+    sizes[i] = 0;
+    if (fds[i] < 0) {
+      fprintf(stderr, "Error opening file %s\n", filenames[i]);
+      continue;
+    }
+    if (fstat(fds[i], &st) < 0 || !S_ISREG(st.st_mode)) {
+      streams[num_streams++] = i;
+      continue;
+    }
+    sizes[i] = st.st_size;
+    WorkDeque *d = &deques[dealt++ % num_threads];
+    d->files[d->tail++] = i;
+  }
+  free(order);
+
+  HashMap *global_map = create_hashmap(HASH_TABLE_SIZE);
+  LOG("Starting work stealing with %d threads...\n", num_threads);
+
+#pragma omp parallel num_threads(num_threads)
+  {
+    int me = omp_get_thread_num();
+    HashMap *local_map = create_hashmap(HASH_TABLE_SIZE);
+    Block block = {.buf = alloc_block_buffer(BLOCK_BUF_SIZE)};
+    ReadTask task;
+
+    // Whole inputs first, as nobody can help with them later.
+    int s;
+    while ((s = atomic_fetch_add(&next_stream, 1)) < num_streams) {
+      BlockReader reader = {.fd = fds[streams[s]]};
+      for (;;) {
+        Stamp start = stamp_now();
+        block.data = read_block(&reader, block.buf, READ_SIZE, delimiters,
+                                &block.len);
+        phase_add(PHASE_READ, start);
+        if (!block.data)
+          break;
+        count_span(local_map, block.data, block.len, 0, block.len,
+                   delimiters);
+        thread_stats[me].busy += omp_get_wtime() - start.seconds;
+      }
+    }
+
+    while (take_work(&deques[me], sizes, &task) ||
+           (steal_work(deques, num_threads, me) &&
+            take_work(&deques[me], sizes, &task))) {
+      Stamp start = stamp_now();
+      ssize_t got = pread_full(fds[task.file], block.buf,
+                               task_read_len(&task), task_read_offset(&task));
+      phase_add(PHASE_READ, start);
+      if (got > 0)
+        drop_cached(fds[task.file], task_read_offset(&task), got);
+      set_task_block(&block, &task, got);
+      count_span(local_map, block.data, block.len, block.begin, block.end,
+                 delimiters);
+      thread_stats[me].busy += omp_get_wtime() - start.seconds;
+    }
+
+    LOG("Thread %d merging results...\n", me);
+    Stamp start = stamp_now();
+    merge_hashmaps(global_map, local_map);
+    phase_add(PHASE_GLOBAL_MERGE, start);
+    if (show_table_stats)
+      record_table_stats(local_map, "thread %d", me);
+    free_hashmap(local_map);
+    free(block.buf);
+  }
+
+  for (int t = 0; t < num_threads; t++) {
+    omp_destroy_lock(&deques[t].lock);
+    free(deques[t].files);
+  }
+  for (int i = 0; i < num_files; i++)
+    if (fds[i] >= 0 && fds[i] != STDIN_FILENO)
+      close(fds[i]);
+  free(deques);
+  free(fds);
+  free(streams);
+  free(sizes);
+  return global_map;
+}
+
+HashMap *process_files_sync(char **filenames, int num_files,
+                            const char *delimiters) {
+  HashMap *global_map = create_hashmap(HASH_TABLE_SIZE);
+  reset_thread_stats(1);
+  for (int i = 0; i < num_files; i++) {
+    HashMap *file_map = process_file_sync(filenames[i], delimiters, i);
+    if (file_map) {
+      Stamp start = stamp_now();
+      merge_hashmaps(global_map, file_map);
+      phase_add(PHASE_FILE_MERGE, start);
+      if (show_table_stats)
+        record_table_stats(file_map, "file %d", i);
+      free_hashmap(file_map);
+    }
+  }
+  return global_map;
+}
+
+HashMap *process_files_parallel(char **filenames, int num_files,
+                                const char *delimiters, int num_threads,
+                                FileReport *reports, int top_n) {
+  if (engine == ENGINE_SYNC && !reports)
+    return process_files_sync(filenames, num_files, delimiters);
+  reset_thread_stats(num_threads);
+
+  // Blocks of one file end up in several maps, which neither per-file
+  // reports nor document frequencies can be built from.
+  if (engine == ENGINE_PIPELINE && !reports && !count_df)
+    return process_files_pipeline(filenames, num_files, delimiters,
+                                  num_threads, num_readers);
+  if (engine == ENGINE_STEAL && !reports && !count_df)
+    return process_files_stealing(filenames, num_files, delimiters,
+                                  num_threads);
+
+  HashMap *global_map = create_hashmap(HASH_TABLE_SIZE);
+  int *order = schedule_order(filenames, num_files);
+
+  LOG("Starting parallel processing with %d threads...\n", num_threads);
+  omp_set_num_threads(num_threads);
+
+#pragma omp parallel shared(global_map, filenames, num_files, delimiters)
+  {
+    int thread_id = omp_get_thread_num();
+    HashMap *local_map = create_hashmap(HASH_TABLE_SIZE);
+
+    if (!local_map) {
+      fprintf(stderr, "Error allocating hash table for thread %d\n", thread_id);
+      exit(1);
+    }
+
+    LOG("Thread %d started\n", thread_id);
+#pragma omp for schedule(dynamic)
+    for (int k = 0; k < num_files; k++) {
+      int i = order[k];
+      double start = omp_get_wtime();
+      LOG("Thread %d processing file %s\n", thread_id, filenames[i]);
+      HashMap *file_map = process_file_sync(filenames[i], delimiters, i);
+      if (file_map) {
+        if (reports)
+          fill_report(&reports[i], file_map, top_n);
+        Stamp merge_start = stamp_now();
+        merge_hashmaps(local_map, file_map);
+        phase_add(PHASE_FILE_MERGE, merge_start);
+        if (show_table_stats)
+          record_table_stats(file_map, "file %d", i);
+        free_hashmap(file_map);
+      }
+      double end = omp_get_wtime();
+      thread_stats[thread_id].busy += end - start;
+      trace_add(TRACE_FILE, start, end, i);
+    }
+    LOG("Thread %d finished processing\n", thread_id);
+    LOG("Thread %d merging results...\n", thread_id);
+    Stamp start = stamp_now();
+    merge_hashmaps(global_map, local_map);
+    phase_add(PHASE_GLOBAL_MERGE, start);
+    LOG("Thread %d merge complete\n", thread_id);
+    if (show_table_stats)
+      record_table_stats(local_map, "thread %d", thread_id);
+
+    free_hashmap(local_map);
+  }
+
+  free(order);
+  return global_map;
+}
+
+void print_word_table(WordFreq *words, int n) {
+  if (count_df) {
+    printf("--------------------------------------\n");
+    printf("| %-16s | %-7s | %-7s |\n", "Word", "Count", "DF");
+    printf("--------------------------------------\n");
+  } else {
+    printf("----------------------------\n");
+    printf("| %-16s | %-7s |\n", "Word", "Count");
+    printf("----------------------------\n");
+  }
+
+  for (int i = 0; i < n; i++) {
+    if (count_df)
+      printf("| %-16s | %-7d | %-7d |\n", words[i].word, words[i].count,
+             words[i].df);
+    else
+      printf("| %-16s | %-7d |\n", words[i].word, words[i].count);
+  }
+  if (count_df)
+    printf("--------------------------------------\n");
+  else
+    printf("----------------------------\n");
+}
+
+void print_file_reports(char **filenames, FileReport *reports, int num_files,
+                        int top_n) {
+  for (int i = 0; i < num_files; i++) {
+    if (!reports[i].top)
+      continue;
+    printf("\nTop %d words in %s (%d unique):\n", top_n, filenames[i],
+           reports[i].items);
+    print_word_table(reports[i].top, reports[i].count);
+  }
+}
+
+void free_file_reports(FileReport *reports, int num_files) {
+  for (int i = 0; i < num_files; i++) {
+    for (int j = 0; j < reports[i].count; j++)
+      free(reports[i].top[j].word);
+    free(reports[i].top);
+  }
+  free(reports);
+}
+
+void print_results(HashMap *map, int top_n, int num_docs) {
+  WordFreq *words = malloc(map->items * sizeof(WordFreq));
+  int idx = 0;
+
+  for (int i = 0; i < map->size; i++) {
+    WordNode *current = map->buckets[i];
+    while (current) {
+      words[idx].word = current->word;
+      words[idx].count = current->count;
+      words[idx].df = current->df;
+      idx++;
+      current = current->next;
+    }
+  }
+
+  Stamp start = stamp_now();
+  qsort(words, map->items, sizeof(WordFreq), compare_words);
+  phase_add(PHASE_SORT, start);
+
+  printf("\nTop %d words by frequency:\n", top_n);
+  if (count_df)
+    printf("(document frequency over %d documents)\n", num_docs);
+  print_word_table(words, map->items < top_n ? map->items : top_n);
+
+  free(words);
+}
+
+void init_stream_counts(StreamCounts *sc, double window, double half_life) {
+  memset(sc, 0, sizeof(*sc));
+  sc->window = window;
+  sc->half_life = half_life;
+  for (int i = 0; i < WINDOW_SLOTS; i++) {
+    sc->slots[i] = window > 0 ? create_hashmap(HASH_TABLE_SIZE) : NULL;
+    sc->slot_epoch[i] = -1;
+  }
+  if (half_life > 0)
+    sc->decayed = create_hashmap(HASH_TABLE_SIZE);
+  sc->decay_base = omp_get_wtime();
+}
+
+void free_stream_counts(StreamCounts *sc) {
+  for (int i = 0; i < WINDOW_SLOTS; i++)
+    if (sc->slots[i])
+      free_hashmap(sc->slots[i]);
+  if (sc->decayed)
+    free_hashmap(sc->decayed);
+}
+
+// Adds the counts of one block that arrived at time now. The window is a
+// ring of sub-window maps stamped with their epoch: a slot still holding an
+// older epoch is cleared when reused, so expiry never rescans the input.
+// Decayed scores are kept relative to decay_base and new counts are weighted
+// up instead of decaying every word; the scores are rescaled, and the base
+// moved, only once the weight reaches DECAY_RESCALE.
+void stream_add(StreamCounts *sc, HashMap *counts, double now) {
+  if (sc->window > 0) {
+    long epoch = (long)(now / (sc->window / WINDOW_SLOTS));
+    int slot = epoch % WINDOW_SLOTS;
+    if (sc->slot_epoch[slot] != epoch) {
+      clear_hashmap(sc->slots[slot]);
+      sc->slot_epoch[slot] = epoch;
+    }
+    merge_hashmaps(sc->slots[slot], counts);
+  }
+
+  if (sc->half_life > 0) {
+    double weight = exp2((now - sc->decay_base) / sc->half_life);
+    if (weight >= DECAY_RESCALE) {
+      for (int i = 0; i < sc->decayed->size; i++)
+        for (WordNode *n = sc->decayed->buckets[i]; n; n = n->next)
+          n->score /= weight;
+      sc->decay_base = now;
+      weight = 1;
+    }
+    merge_hashmaps(sc->decayed, counts);
+    for (int i = 0; i < counts->size; i++)
+      for (WordNode *n = counts->buckets[i]; n; n = n->next)
+        find_word(sc->decayed, n->word)->score += n->count * weight;
+  }
+}
+
+int compare_scores(const void *a, const void *b) {
+  const WordNode *na = *(WordNode *const *)a;
+  const WordNode *nb = *(WordNode *const *)b;
+
+  if (na->score != nb->score)
+    return na->score < nb->score ? 1 : -1;
+
+  return strcmp(na->word, nb->word);
+}
+
+void stream_report(StreamCounts *sc, int top_n, double now) {
+  if (sc->window > 0) {
+    long epoch = (long)(now / (sc->window / WINDOW_SLOTS));
+    HashMap *window = create_hashmap(HASH_TABLE_SIZE);
+    for (int i = 0; i < WINDOW_SLOTS; i++)
+      if (sc->slot_epoch[i] > epoch - WINDOW_SLOTS)
+        merge_hashmaps(window, sc->slots[i]);
+    printf("\nLast %.0f seconds:\n", sc->window);
+    print_results(window, top_n, 1);
+    free_hashmap(window);
+  }
+
+  if (sc->half_life > 0) {
+    HashMap *map = sc->decayed;
+    WordNode **nodes = malloc(map->items * sizeof(WordNode *));
+    int idx = 0;
+    for (int i = 0; i < map->size; i++)
+      for (WordNode *n = map->buckets[i]; n; n = n->next)
+        nodes[idx++] = n;
+    qsort(nodes, idx, sizeof(WordNode *), compare_scores);
+
+    double factor = exp2(-(now - sc->decay_base) / sc->half_life);
+    printf("\nTop %d words, decayed with a %.0f second half-life:\n", top_n,
+           sc->half_life);
+    printf("-------------------------------\n");
+    printf("| %-16s | %-10s |\n", "Word", "Score");
+    printf("-------------------------------\n");
+    for (int i = 0; i < idx && i < top_n; i++)
+      printf("| %-16s | %-10.2f |\n", nodes[i]->word,
+             nodes[i]->score * factor);
+    printf("-------------------------------\n");
+    free(nodes);
+  }
+  fflush(stdout);
+}
+
+// Counts one unbounded input, e.g. a pipe. Each large block is split between
+// the threads, which count into their own maps; every snapshot_every bytes
+// the maps are merged into a snapshot and its top N printed. With stream
+// counts, each block is added to them as it arrives and they are reported
+// every interval seconds instead.
+HashMap *process_stream(int fd, const char *delimiters, int num_threads,
+                        int top_n, unsigned long long snapshot_every,
+                        StreamCounts *sc, int interval) {
+  HashMap **local_maps = malloc(num_threads * sizeof(HashMap *));
+  char *buf = malloc(BLOCK_HEADROOM + STREAM_READ_SIZE);
+  if (!local_maps || !buf) {
+    fprintf(stderr, "Memory allocation error\n");
+    exit(1);
+  }
+  for (int t = 0; t < num_threads; t++)
+    local_maps[t] = create_hashmap(HASH_TABLE_SIZE);
+
+  LOG("Streaming input with %d threads...\n", num_threads);
+  HashMap *global_map = create_hashmap(HASH_TABLE_SIZE);
+  BlockReader reader = {.fd = fd, .partial = sc != NULL};
+  unsigned long long next_snapshot = snapshot_every;
+  double next_report = omp_get_wtime() + interval;
+  char *chunk;
+  size_t len;
+
+  for (;;) {
+    if (sc) {
+      double now = omp_get_wtime();
+      if (now >= next_report) {
+        stream_report(sc, top_n, now);
+        while (next_report <= now)
+          next_report += interval;
+      }
+      struct pollfd pfd = {.fd = fd, .events = POLLIN};
+      if (poll(&pfd, 1, (int)((next_report - now) * 1000) + 1) == 0)
+        continue;
+    }
+
+    chunk = read_block(&reader, buf, STREAM_READ_SIZE, delimiters, &len);
+    if (!chunk)
+      break;
+
+#pragma omp parallel num_threads(num_threads)
+    {
+      int t = omp_get_thread_num();
+      int nt = omp_get_num_threads();
+      count_span(local_maps[t], chunk, len, len * t / nt, len * (t + 1) / nt,
+                 delimiters);
+    }
+
+    if (sc) {
+      double now = omp_get_wtime();
+      for (int t = 0; t < num_threads; t++) {
+        stream_add(sc, local_maps[t], now);
+        merge_hashmaps(global_map, local_maps[t]);
+        clear_hashmap(local_maps[t]);
+      }
+    } else if (snapshot_every && reader.bytes >= next_snapshot) {
+      HashMap *snapshot = create_hashmap(HASH_TABLE_SIZE);
+      for (int t = 0; t < num_threads; t++)
+        merge_hashmaps(snapshot, local_maps[t]);
+      printf("\nSnapshot after %llu bytes:\n", reader.bytes);
+      print_results(snapshot, top_n, 1);
+      fflush(stdout);
+      free_hashmap(snapshot);
+      while (next_snapshot <= reader.bytes)
+        next_snapshot += snapshot_every;
+    }
+  }
+
+  for (int t = 0; t < num_threads; t++) {
+    merge_hashmaps(global_map, local_maps[t]);
+    free_hashmap(local_maps[t]);
+  }
+  free(local_maps);
+  free(buf);
+  LOG("Streamed %llu bytes, items: %d\n", reader.bytes, global_map->items);
+  return global_map;
+}
+
+volatile sig_atomic_t stop_following = 0;
+
+void on_interrupt(int sig) { stop_following = 1; }
+
+// Counts what was appended to file i since the last call into file_map, and
+// into sc through appended when a window or decay is kept. While r->follow is
+// set, a word cut off at the end of the file waits for the rest of it.
+void read_appended(BlockReader *r, HashMap *file_map, HashMap *appended,
+                   char *buf, const char *delimiters, StreamCounts *sc,
+                   int i) {
+  r->eof = 0;
+  HashMap *target = sc ? appended : file_map;
+  target->doc = i;
+  char *chunk;
+  size_t len;
+  while ((chunk = read_block(r, buf, READ_SIZE, delimiters, &len)))
+    count_span(target, chunk, len, 0, len, delimiters);
+  if (sc && appended->items) {
+    stream_add(sc, appended, omp_get_wtime());
+    merge_hashmaps(file_map, appended);
+    clear_hashmap(appended);
+  }
+}
+
+// Tails append-only files until interrupted. Only bytes appended since the
+// last read are counted, into one resident map per file; every interval
+// seconds the maps are merged into a snapshot and its top N printed, or the
+// stream counts fed with the new bytes are reported.
+// Changes are waited for with inotify where available, else by polling.
+HashMap *follow_files(char **filenames, int num_files, const char *delimiters,
+                      int top_n, int interval, StreamCounts *sc) {
+  BlockReader *readers = calloc(num_files, sizeof(BlockReader));
+  HashMap **file_maps = calloc(num_files, sizeof(HashMap *));
+  HashMap *appended = create_hashmap(HASH_TABLE_SIZE);
+  char *buf = malloc(BLOCK_HEADROOM + READ_SIZE);
+  if (!readers || !file_maps || !buf) {
+    fprintf(stderr, "Memory allocation error\n");
+    exit(1);
+  }
+
+  int watch_fd = -1;
+#ifdef __linux__
+  watch_fd = inotify_init1(IN_NONBLOCK);
+#endif
+  for (int i = 0; i < num_files; i++) {
+    readers[i].fd = open(filenames[i], O_RDONLY);
+    readers[i].follow = 1;
+    if (readers[i].fd < 0) {
+      fprintf(stderr, "Error opening file %s\n", filenames[i]);
+      continue;
+    }
+    file_maps[i] = create_hashmap(HASH_TABLE_SIZE);
+    file_maps[i]->doc = i;
+#ifdef __linux__
+    if (watch_fd >= 0 && inotify_add_watch(watch_fd, filenames[i],
+                                           IN_MODIFY) < 0) {
+      close(watch_fd);
+      watch_fd = -1;
+    }
+#endif
+  }
+  LOG("Following %d file(s), %s\n", num_files,
+      watch_fd >= 0 ? "using inotify" : "polling");
+
+  signal(SIGINT, on_interrupt);
+  signal(SIGTERM, on_interrupt);
+  double start = omp_get_wtime();
+  double next_publish = start + interval;
+
+  while (!stop_following) {
+    for (int i = 0; i < num_files; i++) {
+      BlockReader *r = &readers[i];
+      struct stat st;
+      if (r->fd < 0 || fstat(r->fd, &st) < 0)
+        continue;
+      if ((unsigned long long)st.st_size < r->bytes) {
+        LOG("File %s was truncated, reading from the start\n", filenames[i]);
+        lseek(r->fd, 0, SEEK_SET);
+        r->bytes = 0;
+        r->tail_len = 0;
+      }
+      read_appended(r, file_maps[i], appended, buf, delimiters, sc, i);
+    }
+
+    double now = omp_get_wtime();
+    if (sc && now >= next_publish) {
+      stream_report(sc, top_n, now);
+      while (next_publish <= now)
+        next_publish += interval;
+    } else if (now >= next_publish) {
+      HashMap *snapshot = create_hashmap(HASH_TABLE_SIZE);
+      for (int i = 0; i < num_files; i++)
+        if (file_maps[i])
+          merge_hashmaps(snapshot, file_maps[i]);
+      printf("\nSnapshot after %.0f seconds:\n", now - start);
+      print_results(snapshot, top_n, num_files);
+      fflush(stdout);
+      free_hashmap(snapshot);
+      while (next_publish <= now)
+        next_publish += interval;
+    }
+
+    int timeout_ms = (int)((next_publish - now) * 1000) + 1;
+    if (watch_fd >= 0) {
+      struct pollfd pfd = {.fd = watch_fd, .events = POLLIN};
+      if (poll(&pfd, 1, timeout_ms) > 0) {
+        char events[4096];
+        while (read(watch_fd, events, sizeof(events)) > 0)
+          ;
+      }
+    } else {
+      poll(NULL, 0, timeout_ms < 1000 ? timeout_ms : 1000);
+    }
+  }
+
+  // The word at the end of each file counts now that no more will follow.
+  for (int i = 0; i < num_files; i++) {
+    if (readers[i].fd < 0)
+      continue;
+    readers[i].follow = 0;
+    read_appended(&readers[i], file_maps[i], appended, buf, delimiters, sc,
+                  i);
+  }
+
+  HashMap *global_map = create_hashmap(HASH_TABLE_SIZE);
+  for (int i = 0; i < num_files; i++) {
+    if (!file_maps[i])
+      continue;
+    merge_hashmaps(global_map, file_maps[i]);
+    free_hashmap(file_maps[i]);
+    close(readers[i].fd);
+  }
+  if (watch_fd >= 0)
+    close(watch_fd);
+  free_hashmap(appended);
+  free(file_maps);
+  free(readers);
+  free(buf);
+  return global_map;
+}
+
+// Slowest thread's busy time over the mean: 1.0 is a perfectly even split.
+double busy_imbalance(void) {
+  double max = 0, sum = 0;
+  for (int t = 0; t < stats_threads; t++) {
+    sum += thread_stats[t].busy;
+    if (thread_stats[t].busy > max)
+      max = thread_stats[t].busy;
+  }
+  return sum > 0 ? max * stats_threads / sum : 1.0;
+}
+
+typedef struct {
+  double median, min, mean, stddev, ci; // ci: half-width of the 95% interval
+} TimeStats;
+
+int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+// Student's t for a two-sided 95% interval, by degrees of freedom.
+double t_quantile95(int df) {
+  static const double t[] = {0,     12.706, 4.303, 3.182, 2.776, 2.571,
+                             2.447, 2.365,  2.306, 2.262, 2.228, 2.201,
+                             2.179, 2.160,  2.145, 2.131, 2.120, 2.110,
+                             2.101, 2.093,  2.086, 2.080, 2.074, 2.069,
+                             2.064, 2.060,  2.056, 2.052, 2.048, 2.045,
+                             2.042};
+  if (df <= 0)
+    return 0;
+  return df < (int)(sizeof(t) / sizeof(t[0])) ? t[df] : 1.960;
+}
+
+// times stay in run order, the median comes from a sorted copy.
+TimeStats summarize_times(const double *times, int n) {
+  TimeStats st = {0};
+  double sorted[n];
+  memcpy(sorted, times, sizeof(sorted));
+  qsort(sorted, n, sizeof(double), compare_doubles);
+  st.min = sorted[0];
+  st.median = n % 2 ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2;
+  for (int r = 0; r < n; r++)
+    st.mean += times[r] / n;
+  if (n > 1) {
+    double sq = 0;
+    for (int r = 0; r < n; r++)
+      sq += (times[r] - st.mean) * (times[r] - st.mean);
+    st.stddev = sqrt(sq / (n - 1));
+    st.ci = t_quantile95(n - 1) * st.stddev / sqrt(n);
+  }
+  return st;
+}
+
+// Asks the kernel to drop the files' cached pages. Clean pages of a file are
+// dropped for any process that can open it, so this needs no root, unlike
+// writing to /proc/sys/vm/drop_caches.
+void evict_files(char **filenames, int num_files) {
+  for (int i = 0; i < num_files; i++) {
+    int fd = open(filenames[i], O_RDONLY);
+    if (fd < 0)
+      continue;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+  }
+}
+
+// Bytes this process made the kernel fetch from storage, from read_bytes in
+// /proc/self/io; page cache hits do not count. 0 where it is not available.
+unsigned long long device_read_bytes(void) {
+  unsigned long long bytes = 0;
+  char line[128];
+  FILE *f = fopen("/proc/self/io", "r");
+  if (!f)
+    return 0;
+  while (fgets(line, sizeof(line), f))
+    if (sscanf(line, "read_bytes: %llu", &bytes) == 1)
+      break;
+  fclose(f);
+  return bytes;
+}
+
+// Runs one configuration warmup + reps times; threads == 0 is the sync
+// version. Returns the wall times of the timed runs in times[], and the
+// number of runs whose result differed from the run before.
+// With cold set, evicts the inputs before every run, warmup included.
+// *device_bytes is the mean of the bytes read from storage per timed run,
+// *unique the number of unique words.
+int time_runs(char **filenames, int num_files, const char *delimiters,
+              int threads, int reps, int warmup, double *times, int cold,
+              unsigned long long *device_bytes, int *unique) {
+  int changed = 0;
+  unsigned long long fetched = 0;
+  for (int r = -warmup; r < reps; r++) {
+    if (cold)
+      evict_files(filenames, num_files);
+    unsigned long long bytes0 = device_read_bytes();
+    double start = omp_get_wtime();
+    HashMap *map =
+        threads ? process_files_parallel(filenames, num_files, delimiters,
+                                         threads, NULL, 0)
+                : process_files_sync(filenames, num_files, delimiters);
+    double end = omp_get_wtime();
+    if (r >= 0) {
+      times[r] = end - start;
+      fetched += device_read_bytes() - bytes0;
+    }
+    unsigned long long previous = last_fingerprint;
+    if (fingerprint(map) != previous && r > -warmup) {
+      fprintf(stderr, "Error: Results of %d thread(s) changed between runs\n",
+              threads ? threads : 1);
+      changed++;
+    }
+    // The top words a normal run would print, to time the sort phase.
+    WordFreq top[10];
+    select_top_n(map, 10, top);
+    LOG("Unique words with %d thread(s): %d\n", threads ? threads : 1,
+        map->items);
+    if (unique)
+      *unique = map->items;
+    free_hashmap(map);
+  }
+  if (device_bytes)
+    *device_bytes = fetched / reps;
+  return changed;
+}
+
+typedef struct {
+  unsigned long long bytes, tokens;
+} Volume;
+
+Volume total_volume(void) {
+  Volume v = {0, 0};
+  for (int t = 0; t < stats_threads; t++) {
+    v.bytes += thread_stats[t].bytes;
+    v.tokens += thread_stats[t].tokens;
+  }
+  return v;
+}
+
+// Overall rates use the wall time, per-thread rates the thread's busy time.
+void print_throughput(double wall, int unique) {
+  Volume v = total_volume();
+  printf("\nThroughput: %.1f MB, %llu tokens, %d unique words\n",
+         v.bytes / 1e6, v.tokens, unique);
+  printf("  %-8s %10s %12s %10s %9s %11s %9s\n", "Thread", "MB", "Tokens",
+         "New words", "MB/s", "Mtokens/s", "ns/token");
+  for (int t = 0; t <= stats_threads; t++) {
+    const ThreadStats *ts = &thread_stats[t];
+    char label[16] = "Total";
+    double seconds = wall;
+    unsigned long long bytes = v.bytes, tokens = v.tokens, words = unique;
+    if (t < stats_threads) {
+      snprintf(label, sizeof(label), "%d", t);
+      seconds = ts->busy;
+      bytes = ts->bytes;
+      tokens = ts->tokens;
+      words = ts->new_words;
+    }
+    printf("  %-8s %10.1f %12llu %10llu %9.1f %11.2f %9.1f\n", label,
+           bytes / 1e6, tokens, words, seconds > 0 ? bytes / 1e6 / seconds : 0,
+           seconds > 0 ? tokens / 1e6 / seconds : 0,
+           tokens ? seconds * 1e9 / tokens : 0);
+  }
+}
+
+double phase_value(const ThreadStats *ts, int phase, int cycles) {
+  return cycles ? ts->cycles[phase] / 1e6 : ts->phase[phase];
+}
+
+// Per-thread phase times of the last run, in Mcycles too with --rdtsc.
+void print_phase_table(void) {
+  const char *titles[NUM_PHASES] = {"Read",       "Tokenize",   "Insert",
+                                    "File merge", "Glob merge", "Sort"};
+  const char *rule = "-------------------------------------------------------"
+                     "--------------------------------\n";
+
+  for (int cycles = 0; cycles <= use_rdtsc; cycles++) {
+    printf("\nPhase breakdown (%s):\n", cycles ? "Mcycles" : "s");
+    printf("%s| %-6s |", rule, "Thread");
+    for (int p = 0; p < NUM_PHASES; p++)
+      printf(" %-10s |", titles[p]);
+    printf("\n%s", rule);
+
+    double total[NUM_PHASES] = {0};
+    for (int t = 0; t <= stats_threads; t++) {
+      char label[16];
+      if (t < stats_threads)
+        snprintf(label, sizeof(label), "%d", t);
+      else
+        printf("%s", rule);
+      printf("| %-6s |", t < stats_threads ? label : "Total");
+      for (int p = 0; p < NUM_PHASES; p++) {
+        double v = t < stats_threads
+                       ? phase_value(&thread_stats[t], p, cycles)
+                       : total[p];
+        total[p] += v;
+        printf(" %-10.4f |", v);
+      }
+      printf("\n");
+    }
+    printf("%s", rule);
+  }
+}
+
+// Peak RSS, what the result map takes, and the map mallocs and frees of the
+// last run by thread and phase. Phases are charged whatever their spans
+// allocate, so tokenize includes insert; "other" is outside any phase, such
+// as freeing maps.
+void print_mem_stats(HashMap *map) {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  size_t nodes = (size_t)map->items * sizeof(WordNode);
+  size_t buckets = sizeof(HashMap) + map->size * sizeof(WordNode *);
+  size_t strings = 0;
+  for (int i = 0; i < map->size; i++)
+    for (WordNode *current = map->buckets[i]; current; current = current->next)
+      strings += strlen(current->word) + 1;
+
+  printf("\nMemory:\n");
+  printf("  Peak RSS: %.1f MB\n", usage.ru_maxrss / 1024.0);
+  printf("  Result map: %d words, nodes %.2f MB, strings %.2f MB, "
+         "buckets %.2f MB\n",
+         map->items, nodes / 1e6, strings / 1e6, buckets / 1e6);
+  printf("  Bytes per unique word: %.1f (before allocator overhead)\n",
+         map->items ? (double)(nodes + strings + buckets) / map->items : 0);
+
+  printf("\n  Map mallocs/frees by thread and phase (tokenize includes "
+         "insert):\n");
+  printf("  %-6s %15s", "Thread", "total");
+  const int shown[] = {PHASE_READ, PHASE_TOKENIZE, PHASE_FILE_MERGE,
+                       PHASE_GLOBAL_MERGE, PHASE_SORT};
+  for (int k = 0; k < 5; k++)
+    printf(" %15s", phase_names[shown[k]]);
+  printf(" %15s\n", "other");
+  for (int t = 0; t < stats_threads; t++) {
+    ThreadStats *ts = &thread_stats[t];
+    char cell[48];
+    unsigned long long in_phases_m = 0, in_phases_f = 0;
+    printf("  %-6d", t);
+    snprintf(cell, sizeof(cell), "%llu/%llu", ts->mallocs, ts->frees);
+    printf(" %15s", cell);
+    for (int k = 0; k < 5; k++) {
+      snprintf(cell, sizeof(cell), "%llu/%llu", ts->phase_mallocs[shown[k]],
+               ts->phase_frees[shown[k]]);
+      printf(" %15s", cell);
+    }
+    for (int p = 0; p < NUM_PHASES; p++) {
+      in_phases_m += ts->phase_mallocs[p];
+      in_phases_f += ts->phase_frees[p];
+    }
+    snprintf(cell, sizeof(cell), "%llu/%llu", ts->mallocs - in_phases_m,
+             ts->frees - in_phases_f);
+    printf(" %15s\n", cell);
+  }
+}
+
+// Counters by thread and phase, where tokenize includes insert. Misses per
+// token are over all tokens the thread counted.
+void print_perf_table(void) {
+  unsigned long long sum[NUM_PHASES][NUM_PERF] = {{0}};
+  unsigned long long tokens = 0;
+  int any = 0;
+  for (int t = 0; t < stats_threads; t++) {
+    tokens += thread_stats[t].tokens;
+    for (int p = 0; p < NUM_PHASES; p++)
+      for (int e = 0; e < NUM_PERF; e++) {
+        sum[p][e] += thread_stats[t].perf[p][e];
+        any |= thread_stats[t].perf[p][e] != 0;
+      }
+  }
+
+#ifdef HAVE_PERF_EVENTS
+  for (int e = 0; e < NUM_PERF; e++)
+    if (perf_errors[e])
+      fprintf(stderr, "Counter %s not available: %s\n", perf_names[e],
+              strerror(perf_errors[e]));
+#else
+  fprintf(stderr, "Hardware counters are not supported on this platform\n");
+#endif
+  if (!any)
+    return;
+
+  printf("\nHardware counters (tokenize includes insert):\n");
+  printf("  %-6s %-12s %9s %9s %5s %10s %10s %10s\n", "Thread", "Phase",
+         "Mcycles", "Minstr", "IPC", "LLC/token", "Br/token", "dTLB/token");
+  for (int t = 0; t <= stats_threads; t++) {
+    char label[16] = "all";
+    unsigned long long thread_tokens = tokens;
+    if (t < stats_threads) {
+      snprintf(label, sizeof(label), "%d", t);
+      thread_tokens = thread_stats[t].tokens;
+    }
+    for (int p = 0; p < NUM_PHASES; p++) {
+      unsigned long long *v =
+          t < stats_threads ? thread_stats[t].perf[p] : sum[p];
+      if (p == PHASE_INSERT || !v[PERF_CYCLES])
+        continue;
+      double per_token = thread_tokens ? 1.0 / thread_tokens : 0;
+      printf("  %-6s %-12s %9.1f %9.1f %5.2f %10.4f %10.4f %10.4f\n", label,
+             phase_names[p], v[PERF_CYCLES] / 1e6,
+             v[PERF_INSTRUCTIONS] / 1e6,
+             (double)v[PERF_INSTRUCTIONS] / v[PERF_CYCLES],
+             v[PERF_LLC_MISSES] * per_token,
+             v[PERF_BRANCH_MISSES] * per_token,
+             v[PERF_DTLB_MISSES] * per_token);
+    }
+  }
+}
+
+void write_json_string(FILE *f, const char *s) {
+  fputc('"', f);
+  for (; *s; s++) {
+    unsigned char c = *s;
+    if (c == '"' || c == '\\')
+      fprintf(f, "\\%c", c);
+    else if (c < 0x20)
+      fprintf(f, "\\u%04x", c);
+    else
+      fputc(c, f);
+  }
+  fputc('"', f);
+}
+
+// Opens the JSON object with the host and options of the run, so that results
+// from different machines or builds are not compared by mistake.
+void write_json_header(FILE *f, char **filenames, int num_files,
+                       const char *delimiters, int reps, int warmup) {
+  char hostname[256] = "", date[32] = "";
+  struct utsname u;
+  time_t now = time(NULL);
+  if (gethostname(hostname, sizeof(hostname)) != 0)
+    hostname[0] = '\0';
+  hostname[sizeof(hostname) - 1] = '\0';
+  if (uname(&u) != 0)
+    memset(&u, 0, sizeof(u));
+  strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+
+  fprintf(f, "{\"tool\": \"wordfreq_omp\", \"date\": \"%s\",", date);
+  fprintf(f, "\n \"host\": {\"hostname\": ");
+  write_json_string(f, hostname);
+  fprintf(f, ", \"os\": ");
+  write_json_string(f, u.sysname);
+  fprintf(f, ", \"kernel\": ");
+  write_json_string(f, u.release);
+  fprintf(f, ", \"machine\": ");
+  write_json_string(f, u.machine);
+  fprintf(f, ",\n  \"cpus\": %d, \"compiler\": ", omp_get_num_procs());
+  write_json_string(f, __VERSION__);
+  fprintf(f, "},\n \"config\": {\"engine\": \"%s\", \"io\": \"%s\",",
+          engine_names[engine], io_names[io_backend]);
+  fprintf(f, " \"readers\": %d, \"direct_io\": %d, \"keep_order\": %d,",
+          num_readers, direct_io, keep_order);
+  fprintf(f, "\n  \"df\": %d, \"cold\": %d, \"reps\": %d, \"warmup\": %d,",
+          count_df, cold_cache, reps, warmup);
+  fprintf(f, " \"delimiters\": ");
+  write_json_string(f, delimiters);
+  fprintf(f, ",\n  \"files\": [");
+  for (int i = 0; i < num_files; i++) {
+    fprintf(f, "%s", i ? ", " : "");
+    write_json_string(f, filenames[i]);
+  }
+  fprintf(f, "]},\n");
+}
+
+// Writes {"read": ..., ...} for one thread, or summed over all threads when
+// thread is -1.
+void write_phase_values(FILE *f, int thread, int cycles) {
+  fprintf(f, "{");
+  for (int p = 0; p < NUM_PHASES; p++) {
+    double v = 0;
+    for (int t = 0; t < stats_threads; t++)
+      if (thread < 0 || t == thread)
+        v += cycles ? thread_stats[t].cycles[p] : thread_stats[t].phase[p];
+    fprintf(f, "%s\"%s\": %.*f", p ? ", " : "", phase_names[p], cycles ? 0 : 6,
+            v);
+  }
+  fprintf(f, "}");
+}
+
+// Writes the phase times of the last run as one JSON object.
+void write_phase_json(FILE *f, const char *label, double wall, int unique) {
+  Volume v = total_volume();
+  fprintf(f, "{\"label\": \"%s\", \"threads\": %d, \"wall_seconds\": %.6f,",
+          label, stats_threads, wall);
+  fprintf(f, "\n \"bytes\": %llu, \"tokens\": %llu, \"unique\": %d,", v.bytes,
+          v.tokens, unique);
+  fprintf(f, " \"fingerprint\": \"%016llx\",", last_fingerprint);
+  fprintf(f, "\n \"seconds\": ");
+  write_phase_values(f, -1, 0);
+  if (use_rdtsc) {
+    fprintf(f, ",\n \"cycles\": ");
+    write_phase_values(f, -1, 1);
+  }
+  if (perf_counters) {
+    fprintf(f, ",\n \"perf\": {");
+    for (int p = 0; p < NUM_PHASES; p++) {
+      fprintf(f, "%s\"%s\": {", p ? ", " : "", phase_names[p]);
+      for (int e = 0; e < NUM_PERF; e++) {
+        unsigned long long v = 0;
+        for (int t = 0; t < stats_threads; t++)
+          v += thread_stats[t].perf[p][e];
+        fprintf(f, "%s\"%s\": %llu", e ? ", " : "", perf_names[e], v);
+      }
+      fprintf(f, "}");
+    }
+    fprintf(f, "}");
+  }
+  fprintf(f, ",\n \"per_thread\": [");
+  for (int t = 0; t < stats_threads; t++) {
+    const ThreadStats *ts = &thread_stats[t];
+    fprintf(f, "%s\n  {\"thread\": %d, \"busy_seconds\": %.6f,", t ? "," : "",
+            t, ts->busy);
+    fprintf(f, " \"bytes\": %llu, \"tokens\": %llu, \"new_words\": %llu,",
+            ts->bytes, ts->tokens, ts->new_words);
+    fprintf(f, "\n   \"seconds\": ");
+    write_phase_values(f, t, 0);
+    if (use_rdtsc) {
+      fprintf(f, ", \"cycles\": ");
+      write_phase_values(f, t, 1);
+    }
+    fprintf(f, "}");
+  }
+  fprintf(f, "]}");
+}
+
+// Writes one benchmark row: every repetition's time, so that runs can be
+// tested against each other, the summary, and the phases of the last run.
+void write_bench_json(FILE *f, const char *label, int threads,
+                      const double *times, int reps, TimeStats st,
+                      double speedup, double imbalance, int unique) {
+  Volume v = total_volume();
+  fprintf(f, "{\"label\": \"%s\", \"threads\": %d, \"reps\": %d,", label,
+          threads, reps);
+  fprintf(f, "\n \"times\": [");
+  for (int r = 0; r < reps; r++)
+    fprintf(f, "%s%.6f", r ? ", " : "", times[r]);
+  fprintf(f, "],\n \"median\": %.6f, \"min\": %.6f, \"mean\": %.6f,",
+          st.median, st.min, st.mean);
+  fprintf(f, " \"stddev\": %.6f, \"ci95\": %.6f,", st.stddev, st.ci);
+  fprintf(f, "\n \"speedup\": %.4f, \"efficiency\": %.4f,", speedup,
+          speedup / threads);
+  fprintf(f, " \"imbalance\": %.4f, \"fingerprint\": \"%016llx\",", imbalance,
+          last_fingerprint);
+  fprintf(f, "\n \"throughput\": {\"mb_per_s\": %.2f, \"mtokens_per_s\": %.3f,",
+          v.bytes / 1e6 / st.median, v.tokens / 1e6 / st.median);
+  fprintf(f, " \"ns_per_token\": %.3f},",
+          v.tokens ? st.median * 1e9 / v.tokens : 0);
+  fprintf(f, "\n \"last_run\": ");
+  write_phase_json(f, label, times[reps - 1], unique);
+  fprintf(f, "}");
+}
+
+// Reports a method whose last run counted differently from the reference.
+int check_fingerprint(const char *label, unsigned long long expected) {
+  if (last_fingerprint == expected)
+    return 0;
+  fprintf(stderr, "Error: %s result fingerprint %016llx differs from %016llx\n",
+          label, last_fingerprint, expected);
+  return 1;
+}
+
+// Returns the number of methods whose results differ from the sync version,
+// plus the runs whose results differ from the run before them.
+int run_benchmark(char **filenames, int num_files, const char *delimiters,
+                  int *thread_counts, int num_counts, int reps, int warmup,
+                  FILE *json) {
+  double *times = malloc(reps * sizeof(double));
+  // Phase totals over all threads of the last run and the median times,
+  // sync first.
+  double(*phases)[NUM_PHASES] = calloc(num_counts + 1, sizeof(*phases));
+  double *medians = malloc((num_counts + 1) * sizeof(double));
+  // With --cold: medians with the inputs evicted, and bytes read from
+  // storage per run, warm and cold.
+  double *cold_medians = calloc(num_counts + 1, sizeof(double));
+  unsigned long long(*device)[2] = calloc(num_counts + 1, sizeof(*device));
+  double *busy = malloc(num_counts * MAX_THREADS * sizeof(double));
+  int *busy_threads = malloc(num_counts * sizeof(int));
+  const char *rule = "---------------------------------------------------------"
+                     "---------------------------------\n";
+
+  printf("\nBenchmark results (%d run(s) each, %d warmup):\n", reps, warmup);
+  printf("%s", rule);
+  printf("| %-12s | %-9s | %-9s | %-8s | %-9s | %-7s | %-5s | %-6s |\n",
+         "Method", "Median(s)", "Min (s)", "Stddev", "95% CI +-", "Speedup",
+         "Eff.", "Imbal.");
+  printf("%s", rule);
+
+  LOG("Running sync version...\n");
+  int unique = 0;
+  // Runs that counted differently from the run before them or from the sync
+  // version.
+  int mismatches = time_runs(filenames, num_files, delimiters, 0, reps, warmup,
+                             times, 0, &device[0][0], &unique);
+  Volume volume = total_volume();
+  TimeStats sync = summarize_times(times, reps);
+  // Every method must count what the sync version counted.
+  unsigned long long expected = last_fingerprint;
+  medians[0] = sync.median;
+  for (int t = 0; t < stats_threads; t++)
+    for (int p = 0; p < NUM_PHASES; p++)
+      phases[0][p] += thread_stats[t].phase[p];
+  if (json) {
+    write_json_header(json, filenames, num_files, delimiters, reps, warmup);
+    fprintf(json, " \"benchmark\": [\n");
+    write_bench_json(json, "Sync", 1, times, reps, sync, 1.0, 1.0, unique);
+  }
+  printf("| %-12s | %-9.4f | %-9.4f | %-8.4f | %-9.4f | %-7.3f | %-5.2f | "
+         "%-6.3f |\n",
+         "Sync", sync.median, sync.min, sync.stddev, sync.ci, 1.0, 1.0, 1.0);
+  if (cold_cache) {
+    LOG("Running sync version on a cold cache...\n");
+    mismatches += time_runs(filenames, num_files, delimiters, 0, reps, 0,
+                            times, 1, &device[0][1], NULL);
+    mismatches += check_fingerprint("Sync cold", expected);
+    TimeStats st = summarize_times(times, reps);
+    cold_medians[0] = st.median;
+    if (json) {
+      fprintf(json, ",\n");
+      write_bench_json(json, "Sync cold", 1, times, reps, st, 1.0, 1.0,
+                       unique);
+    }
+  }
+
+  for (int i = 0; i < num_counts; i++) {
+    int threads = thread_counts[i];
+
+    LOG("Running parallel version with %d threads...\n", threads);
+    mismatches += time_runs(filenames, num_files, delimiters, threads, reps,
+                            warmup, times, 0, &device[i + 1][0], NULL);
+    TimeStats st = summarize_times(times, reps);
+    double speedup = sync.median / st.median;
+    medians[i + 1] = st.median;
+
+    char label[32];
+    snprintf(label, sizeof(label), "Parallel (%d)", threads);
+    mismatches += check_fingerprint(label, expected);
+    double imbalance = busy_imbalance();
+    printf("| %-12s | %-9.4f | %-9.4f | %-8.4f | %-9.4f | %-7.3f | %-5.2f | "
+           "%-6.3f |\n",
+           label, st.median, st.min, st.stddev, st.ci, speedup,
+           speedup / threads, imbalance);
+    for (int t = 0; t < stats_threads; t++)
+      for (int p = 0; p < NUM_PHASES; p++)
+        phases[i + 1][p] += thread_stats[t].phase[p];
+    if (json) {
+      fprintf(json, ",\n");
+      write_bench_json(json, label, threads, times, reps, st, speedup,
+                       imbalance, unique);
+    }
+    // Busy times of the last run.
+    busy_threads[i] = stats_threads;
+    for (int t = 0; t < stats_threads; t++)
+      busy[i * MAX_THREADS + t] = thread_stats[t].busy;
+
+    if (cold_cache) {
+      LOG("Running parallel version with %d threads on a cold cache...\n",
+          threads);
+      mismatches += time_runs(filenames, num_files, delimiters, threads,
+                              reps, 0, times, 1, &device[i + 1][1], NULL);
+      TimeStats cold = summarize_times(times, reps);
+      cold_medians[i + 1] = cold.median;
+      snprintf(label, sizeof(label), "Parallel (%d) cold", threads);
+      mismatches += check_fingerprint(label, expected);
+      if (json) {
+        fprintf(json, ",\n");
+        write_bench_json(json, label, threads, times, reps, cold,
+                         cold_medians[0] / cold.median, busy_imbalance(),
+                         unique);
+      }
+    }
+  }
+
+  printf("%s", rule);
+  if (mismatches)
+    printf("\nResult fingerprints: %d mismatch(es) between runs or with "
+           "sync, see above\n", mismatches);
+  else
+    printf("\nResult fingerprint %016llx, the same for every method\n",
+           expected);
+
+  printf("\nPer-thread busy time (s), files %s:\n",
+         keep_order ? "in given order" : "largest first");
+  for (int i = 0; i < num_counts; i++) {
+    printf("  Parallel (%d):", thread_counts[i]);
+    for (int t = 0; t < busy_threads[i]; t++)
+      printf(" %.3f", busy[i * MAX_THREADS + t]);
+    printf("\n");
+  }
+
+  printf("\nThroughput at the median time (%.1f MB, %llu tokens, %d unique):\n",
+         volume.bytes / 1e6, volume.tokens, unique);
+  printf("  %-13s %10s %11s %9s\n", "Method", "MB/s", "Mtokens/s", "ns/token");
+  for (int i = 0; i <= num_counts; i++) {
+    char label[32] = "Sync";
+    if (i > 0)
+      snprintf(label, sizeof(label), "Parallel (%d)", thread_counts[i - 1]);
+    printf("  %-13s %10.1f %11.2f %9.2f\n", label,
+           volume.bytes / 1e6 / medians[i], volume.tokens / 1e6 / medians[i],
+           volume.tokens ? medians[i] * 1e9 / volume.tokens : 0);
+  }
+
+  if (cold_cache) {
+    printf("\nWarm and cold page cache, median (s), MB read from storage per "
+           "run:\n");
+    printf("  %-13s %9s %9s %9s %9s %9s %9s\n", "Method", "Warm", "Cold",
+           "Cold/Warm", "Speedup", "Warm MB", "Cold MB");
+    for (int i = 0; i <= num_counts; i++) {
+      char label[32] = "Sync";
+      if (i > 0)
+        snprintf(label, sizeof(label), "Parallel (%d)", thread_counts[i - 1]);
+      printf("  %-13s %9.4f %9.4f %9.2f %9.3f %9.1f %9.1f\n", label,
+             medians[i], cold_medians[i], cold_medians[i] / medians[i],
+             cold_medians[0] / cold_medians[i], device[i][0] / 1e6,
+             device[i][1] / 1e6);
+    }
+    if (device[0][1] == 0)
+      printf("  No reads reached storage: the files may be on tmpfs, still "
+             "dirty, or\n  /proc/self/io is not available.\n");
+  }
+
+  if (phase_timing) {
+    printf("\nPhase totals over all threads, last run (s):\n");
+    printf("  %-13s", "Method");
+    for (int p = 0; p < NUM_PHASES; p++)
+      printf(" %12s", phase_names[p]);
+    printf("\n");
+    for (int i = 0; i <= num_counts; i++) {
+      char label[32] = "Sync";
+      if (i > 0)
+        snprintf(label, sizeof(label), "Parallel (%d)", thread_counts[i - 1]);
+      printf("  %-13s", label);
+      for (int p = 0; p < NUM_PHASES; p++)
+        printf(" %12.4f", phases[i][p]);
+      printf("\n");
+    }
+  }
+  if (json)
+    fprintf(json, "\n]}\n");
+
+  free(medians);
+  free(cold_medians);
+  free(device);
+  free(phases);
+  free(busy_threads);
+  free(busy);
+  free(times);
+  return mismatches;
+}
+
+// Parses a comma separated list of thread counts such as 1,2,4,8.
+// Returns the number of counts, or 0 if the list is invalid.
+int parse_thread_list(const char *arg, int *counts, int max) {
+  int n = 0;
+  const char *p = arg;
+  while (*p && n < max) {
+    char *end;
+    long threads = strtol(p, &end, 10);
+    if (end == p || threads <= 0 || threads > MAX_THREADS ||
+        (*end && *end != ','))
+      return 0;
+    counts[n++] = threads;
+    p = *end ? end + 1 : end;
+  }
+  return *p ? 0 : n;
+}
+
+// Parses durations such as 90, 30s, 10m or 1h into seconds.
+double parse_duration(const char *arg) {
+  char *end;
+  double seconds = strtod(arg, &end);
+  switch (*end) {
+  case 'h':
+    seconds *= 60;
+    /* fall through */
+  case 'm':
+    seconds *= 60;
+    /* fall through */
+  case 's':
+    end++;
+    break;
+  }
+  return *end ? 0 : seconds;
+}
+
+// Parses sizes such as 512K, 64MB or 1GB.
+unsigned long long parse_size(const char *arg) {
+  char *end;
+  unsigned long long size = strtoull(arg, &end, 10);
+  switch (toupper(*end)) {
+  case 'K':
+    size <<= 10;
+    end++;
+    break;
+  case 'M':
+    size <<= 20;
+    end++;
+    break;
+  case 'G':
+    size <<= 30;
+    end++;
+    break;
+  }
+  if (toupper(*end) == 'B')
+    end++;
+  return *end ? 0 : size;
+}
+
+void print_usage() {
+  printf("Usage: program [options] file1 [file2 ...]\n");
+  printf("       program [options] -   (read from stdin)\n");
+  printf("Options:\n");
+  printf("  -n <num>          Number of threads (default: 4)\n");
+  printf("  -d <delimiters>   Delimiters (default: \" ,.!?;:\")\n");
+  printf("  -t <num>          Top N words to print (default: 10)\n");
+  printf("  -b                Run benchmark mode\n");
+  printf("  --threads <list>  Benchmark: thread counts, e.g. 1,2,4,8\n");
+  printf("                    (default: powers of two up to -n, or 2,4,8)\n");
+  printf("  --reps <num>      Benchmark: timed runs per thread count "
+         "(default: 5)\n");
+  printf("  --warmup <num>    Benchmark: untimed runs before them "
+         "(default: 1)\n");
+  printf("  -r                Show top N words\n");
+  printf("  --df              Count the number of files each word occurs in\n");
+  printf("  --per-file        Also show top N words of every file\n");
+  printf("  --snapshot-every <size>\n");
+  printf("                    Print top N every <size> bytes of stdin\n");
+  printf("  --follow          Keep counting data appended to the files\n");
+  printf("  --interval <sec>  Seconds between snapshots (default: 10)\n");
+  printf("  --window <time>   Stream: report only the last <time>, e.g. 10m\n");
+  printf("  --decay <time>    Stream: report counts with half-life <time>\n");
+  printf("  --engine <name>   files: one thread per file (default)\n");
+  printf("                    pipeline: reader threads feed tokenizers\n");
+  printf("                    steal: threads split and steal file chunks\n");
+  printf("                    sync: one thread, the benchmark baseline\n");
+  printf("  --readers <num>   Reader threads of the pipeline (default: 1)\n");
+  printf("  --io <reader>     Pipeline reader: read (default), pread, uring\n");
+  printf("  --direct-io       Bypass the page cache\n");
+  printf("  --keep-order      Hand out files as given, not largest first\n");
+  printf("  --fingerprint     Show a digest of all word counts, equal for\n");
+  printf("                    equal results of any engine\n");
+  printf("  --cold            Benchmark: also time runs with the inputs\n");
+  printf("                    evicted from the page cache\n");
+  printf("  --phases          Show the time every thread spent per phase\n");
+  printf("  --rdtsc           Also count phase cycles with the TSC\n");
+  printf("  --json <file>     Write the run or benchmark with its host and\n");
+  printf("                    options as JSON (- for stdout)\n");
+  printf("  --table-stats     Show chain lengths and probes of every map\n");
+  printf("  --perf-counters   Show IPC and cache, branch and TLB misses\n");
+  printf("  --trace <file>    Write a Chrome trace of every thread's work\n");
+  printf("  --mem-stats       Show peak RSS, map sizes and allocations\n");
+  printf("  -v                Disable verbose output\n");
+  printf("  -h                Show help\n");
+}
+
+// bench_micro.c includes this file for its functions and has its own main.
+#ifndef WORDFREQ_NO_MAIN
+int main(int argc, char **argv) {
+  char *delimiters = " ,.!?;:";
+  int top_n = 10;
+  int run_bench = 0;
+  int print_list = 0;
+  int num_threads = 4;
+  int per_file = 0;
+  unsigned long long snapshot_every = 0;
+  int follow = 0;
+  int interval = 10;
+  double window = 0;
+  double half_life = 0;
+  int thread_counts[MAX_THREADS];
+  int num_counts = 0;
+  int threads_given = 0;
+  int reps = 5;
+  int warmup = 1;
+  const char *json_path = NULL;
+  const char *trace_path = NULL;
+  int status = 0;
+
+  int i;
+  for (i = 1; i < argc; i++) {
+    if (argv[i][0] != '-' || argv[i][1] == '\0')
+      break;
+
+    if (strcmp(argv[i], "--df") == 0) {
+      count_df = 1;
+      continue;
+    }
+    if (strcmp(argv[i], "--per-file") == 0) {
+      per_file = 1;
+      continue;
+    }
+    if (strcmp(argv[i], "--snapshot-every") == 0 && i + 1 < argc) {
+      snapshot_every = parse_size(argv[++i]);
+      if (!snapshot_every) {
+        fprintf(stderr, "Invalid size: %s\n", argv[i]);
+        return 1;
+      }
+      continue;
+    }
+    if (strcmp(argv[i], "--follow") == 0) {
+      follow = 1;
+      continue;
+    }
+    if (strcmp(argv[i], "--interval") == 0 && i + 1 < argc) {
+      interval = atoi(argv[++i]);
+      if (interval <= 0)
+        return 1;
+      continue;
+    }
+    if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {
+      i++;
+      if (strcmp(argv[i], "files") == 0) {
+        engine = ENGINE_FILES;
+      } else if (strcmp(argv[i], "pipeline") == 0) {
+        engine = ENGINE_PIPELINE;
+      } else if (strcmp(argv[i], "steal") == 0) {
+        engine = ENGINE_STEAL;
+      } else if (strcmp(argv[i], "sync") == 0) {
+        engine = ENGINE_SYNC;
+      } else {
+        fprintf(stderr, "Unknown engine: %s\n", argv[i]);
+        return 1;
+      }
+      continue;
+    }
+    if (strcmp(argv[i], "--io") == 0 && i + 1 < argc) {
+      i++;
+      engine = ENGINE_PIPELINE;
+      if (strcmp(argv[i], "read") == 0) {
+        io_backend = IO_READ;
+      } else if (strcmp(argv[i], "pread") == 0) {
+        io_backend = IO_PREAD;
+      } else if (strcmp(argv[i], "uring") == 0) {
+        io_backend = IO_URING;
+      } else {
+        fprintf(stderr, "Unknown reader: %s\n", argv[i]);
+        return 1;
+      }
+      continue;
+    }
+    if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      num_counts = parse_thread_list(argv[++i], thread_counts, MAX_THREADS);
+      if (!num_counts) {
+        fprintf(stderr, "Invalid thread list: %s\n", argv[i]);
+        return 1;
+      }
+      continue;
+    }
+    if (strcmp(argv[i], "--reps") == 0 && i + 1 < argc) {
+      reps = atoi(argv[++i]);
+      if (reps <= 0)
+        return 1;
+      continue;
+    }
+    if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc) {
+      warmup = atoi(argv[++i]);
+      if (warmup < 0)
+        return 1;
+      continue;
+    }
+    if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+      trace_path = argv[++i];
+      tracing = 1;
+      trace_origin = omp_get_wtime();
+      continue;
+    }
+    if (strcmp(argv[i], "--mem-stats") == 0) {
+      mem_stats = 1;
+      continue;
+    }
+    if (strcmp(argv[i], "--perf-counters") == 0) {
+      perf_counters = 1;
+      continue;
+    }
+    if (strcmp(argv[i], "--table-stats") == 0) {
+      show_table_stats = 1;
+      continue;
+    }
+    if (strcmp(argv[i], "--phases") == 0) {
+      phase_timing = 1;
+      continue;
+    }
+    if (strcmp(argv[i], "--rdtsc") == 0) {
+#ifdef HAVE_RDTSC
+      phase_timing = use_rdtsc = 1;
+      continue;
+#else
+      fprintf(stderr, "Error: --rdtsc needs an x86 CPU\n");
+      return 1;
+#endif
+    }
+    if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+      json_path = argv[++i];
+      continue;
+    }
+    if (strcmp(argv[i], "--fingerprint") == 0) {
+      show_fingerprint = 1;
+      continue;
+    }
+    if (strcmp(argv[i], "--cold") == 0) {
+      cold_cache = 1;
+      continue;
+    }
+    if (strcmp(argv[i], "--keep-order") == 0) {
+      keep_order = 1;
+      continue;
+    }
+    if (strcmp(argv[i], "--direct-io") == 0) {
+      direct_io = 1;
+      continue;
+    }
+    if (strcmp(argv[i], "--readers") == 0 && i + 1 < argc) {
+      num_readers = atoi(argv[++i]);
+      if (num_readers <= 0 || num_readers >= MAX_THREADS) {
+        fprintf(stderr, "Invalid number of readers: %s\n", argv[i]);
+        return 1;
+      }
+      continue;
+    }
+    if ((strcmp(argv[i], "--window") == 0 ||
+         strcmp(argv[i], "--decay") == 0) &&
+        i + 1 < argc) {
+      double seconds = parse_duration(argv[i + 1]);
+      if (seconds <= 0) {
+        fprintf(stderr, "Invalid duration: %s\n", argv[i + 1]);
+        return 1;
+      }
+      if (argv[i][2] == 'w')
+        window = seconds;
+      else
+        half_life = seconds;
+      i++;
+      continue;
+    }
+
+    switch (argv[i][1]) {
+    case 'd':
+      if (i + 1 < argc)
+        delimiters = argv[++i];
       break;
     case 't':
       if (i + 1 < argc)
@@ -338,9 +3080,13 @@ int main(int argc, char **argv) {
       print_list = 1;
       break;
     case 'n':
-      num_threads = atoi(argv[++i]);
-      if (num_threads <= 0)
+      num_threads = i + 1 < argc ? atoi(argv[++i]) : 0;
+      if (num_threads <= 0 || num_threads > MAX_THREADS) {
+        fprintf(stderr, "Error: -n must be between 1 and %d\n", MAX_THREADS);
+        print_usage();
         return 1;
+      }
+      threads_given = 1;
       break;
     case 'v':
       verbose = 1;
@@ -364,24 +3110,136 @@ int main(int argc, char **argv) {
   int num_files = argc - i;
   char **filenames = &argv[i];
 
+  // Direct reads need buffers that run ahead of the tokenizers.
+  if (direct_io && engine == ENGINE_FILES)
+    engine = ENGINE_PIPELINE;
+
+  // Pipeline readers run next to the tokenizers, and every thread of the
+  // team has a slot in thread_stats.
+  if (engine == ENGINE_PIPELINE) {
+    int most = run_bench && !threads_given && !num_counts ? 8 : num_threads;
+    for (int c = 0; c < num_counts; c++)
+      if (thread_counts[c] > most)
+        most = thread_counts[c];
+    if (num_readers + most > MAX_THREADS) {
+      fprintf(stderr, "Error: %d readers and %d threads exceed %d threads\n",
+              num_readers, most, MAX_THREADS);
+      return 1;
+    }
+  }
+
   LOG("Starting word frequency count on %d file(s)\n", num_files);
   LOG("Using delimiters: '%s'\n", delimiters);
 
-  if (run_bench) {
-    run_benchmark(filenames, num_files, delimiters);
+  int from_stdin = num_files == 1 && strcmp(filenames[0], "-") == 0;
+  StreamCounts stream_counts;
+  StreamCounts *sc = NULL;
+  if ((window > 0 || half_life > 0) && (run_bench || !(from_stdin || follow))) {
+    fprintf(stderr, "Error: --window and --decay need stdin or --follow\n");
+    return 1;
+  }
+  if (window > 0 || half_life > 0) {
+    init_stream_counts(&stream_counts, window, half_life);
+    sc = &stream_counts;
+  }
+
+  FILE *json = NULL;
+  if (json_path) {
+    json = strcmp(json_path, "-") == 0 ? stdout : fopen(json_path, "w");
+    if (!json) {
+      perror(json_path);
+      return 1;
+    }
+    phase_timing = 1;
+  }
+
+  if (run_bench && from_stdin) {
+    fprintf(stderr, "Error: Benchmark mode needs named input files\n");
+    return 1;
+  } else if (run_bench) {
+    if (!num_counts && threads_given) {
+      for (int t = 1; t < num_threads; t *= 2)
+        thread_counts[num_counts++] = t;
+      thread_counts[num_counts++] = num_threads;
+    } else if (!num_counts) {
+      for (int t = 2; t <= 8; t *= 2)
+        thread_counts[num_counts++] = t;
+    }
+    if (run_benchmark(filenames, num_files, delimiters, thread_counts,
+                      num_counts, reps, warmup, json))
+      status = 1;
+  } else if (follow && !from_stdin) {
+    HashMap *map =
+        follow_files(filenames, num_files, delimiters, top_n, interval, sc);
+    if (print_list) {
+      print_results(map, top_n, num_files);
+    }
+
+    free_hashmap(map);
+  } else if (from_stdin) {
+    double start = omp_get_wtime();
+    HashMap *map = process_stream(STDIN_FILENO, delimiters, num_threads,
+                                  top_n, snapshot_every, sc, interval);
+    double end = omp_get_wtime();
+
+    printf("\nExecution time: %.6f seconds\n", end - start);
+    if (print_list) {
+      print_results(map, top_n, 1);
+    }
+    if (show_fingerprint)
+      printf("Fingerprint: %016llx\n", fingerprint(map));
+
+    free_hashmap(map);
   } else {
+    FileReport *reports =
+        per_file ? calloc(num_files, sizeof(FileReport)) : NULL;
     double start = omp_get_wtime();
-    HashMap *map =
-        process_files_parallel(filenames, num_files, delimiters, num_threads);
+    HashMap *map = process_files_parallel(filenames, num_files, delimiters,
+                                          num_threads, reports, top_n);
     double end = omp_get_wtime();
 
     printf("\nExecution time: %.6f seconds\n", end - start);
+    if (reports) {
+      print_file_reports(filenames, reports, num_files, top_n);
+      free_file_reports(reports, num_files);
+    }
     if (print_list) {
-      print_results(map, top_n);
+      print_results(map, top_n, num_files);
+    }
+    fingerprint(map);
+    if (show_fingerprint)
+      printf("Fingerprint: %016llx\n", last_fingerprint);
+    print_throughput(end - start, map->items);
+    if (phase_timing)
+      print_phase_table();
+    if (perf_counters)
+      print_perf_table();
+    if (mem_stats)
+      print_mem_stats(map);
+    if (show_table_stats) {
+      record_table_stats(map, "global", 0);
+      print_table_stats();
+    }
+    if (json) {
+      // Per-file reports and --df always run the files engine.
+      if (per_file || (count_df && engine != ENGINE_SYNC))
+        engine = ENGINE_FILES;
+      write_json_header(json, filenames, num_files, delimiters, 1, 0);
+      fprintf(json, " \"run\": ");
+      write_phase_json(json, engine_names[engine], end - start, map->items);
+      fprintf(json, "}\n");
     }
 
     free_hashmap(map);
   }
 
-  return 0;
+  if (json && json != stdout)
+    fclose(json);
+  free(table_stats);
+  if (trace_path && write_trace(trace_path) != 0)
+    return 1;
+  if (sc)
+    free_stream_counts(sc);
+  return status;
 }
+#endif